@@ -1,9 +1,18 @@
 #include <Arduino.h>
 #include <WiFi.h>
 #include <HTTPClient.h>
+#include <WiFiClientSecure.h>
 #include <ArduinoJson.h>
 #include <WiFiManager.h>
 #include <Preferences.h>
+#include <WebServer.h>
+#include <esp_pm.h>
+#include <esp_sleep.h>
+#include <esp_idf_version.h>
+#include <driver/gpio.h>
+#include <esp_sntp.h>
+#include <esp_timer.h>
+#include <sys/time.h>
 
 // ======================= Pin Mapping (same as your code) =======================
 // #define RELAY0 23
@@ -33,14 +42,28 @@
 #define OPTO_ACTIVE_LOW 1
 
 // ======================= Network Config =======================
-char HOST_IP[16] = "192.168.0.131";
-char DEVICE_ID[16] = "DEV001";
-char DEVICE_ID2[16] = "DEV002";
+// Runtime parameters live in a double-buffered config: the loop task is the
+// only writer and stages changes in the inactive slot before flipping
+// activeConfigSlot, so readers never see a half-applied change.
+struct RuntimeConfig {
+  char hostIp[16];
+  char deviceId[16];
+  char deviceId2[16];
+  float price;
+  int invoiceDurationSec;
+  char description[64];
+  char backends[72];
+};
+
+static const RuntimeConfig CONFIG_DEFAULTS = {
+  "192.168.0.131", "DEV001", "DEV002", 5.00f, 60, "Sim payment", ""
+};
+static RuntimeConfig configSlots[2] = { CONFIG_DEFAULTS, CONFIG_DEFAULTS };
+static volatile uint8_t activeConfigSlot = 0;
+static portMUX_TYPE configMux = portMUX_INITIALIZER_UNLOCKED;
+static volatile bool configPersistPending = false;
 static const bool DEVICE2_ENABLED = true;
 const uint16_t HOST_PORT = 8000;
-float PRICE = 5.00f;
-int INVOICE_DURATION = 60;
-char DESCRIPTION[64] = "Sim payment";
 char ACTIVE_DEVICE_ID[16] = "";
 
 static Preferences prefs;
@@ -48,11 +71,65 @@ static const char* NVS_NS = "scanpay";
 static const char* NVS_KEY_INV_DURATION = "inv_duration";
 static const bool WIFI_AP_CONFIG_ON_BOOT = true;
 static const uint32_t WIFI_CONFIG_PORTAL_TIMEOUT_MS = 300000;
+static const uint32_t WIFI_PORTAL_CONNECT_TIMEOUT_MS = 10000;
+static const uint32_t WIFI_PORTAL_PROCESS_INTERVAL_MS = 10;
 static const uint32_t HTTP_POLL_INTERVAL_MS = 2000;
 static const uint16_t HTTP_TIMEOUT_MS = 2000;
 static const uint16_t INVOICE_HTTP_TIMEOUT_MS = 10000;
+static const bool INVOICE_BATCH_ENABLED = true;
+static const uint32_t INVOICE_BATCH_RETRY_MS = 600000;
 static const uint32_t RELAY_WATCHDOG_GRACE_MS = 1000;
+static const char* NVS_KEY_RELAY_CHECKPOINT = "relay_ckpt";
 static const uint32_t STATUS_INTERVAL_MS = 1000;
+static const uint8_t PENDING_COMMANDS_PER_DEVICE = 4;
+static const char* NVS_KEY_CMD_DEDUPE = "cmd_dedupe";
+static const uint16_t CONFIG_API_PORT = 8080;
+// Sent as X-Config-Token on POST /config. The HTTP config API only starts
+// when a token is set; UART commands work either way.
+static const char* CONFIG_API_TOKEN = "";
+static const size_t UART_COMMAND_MAX_LEN = 96;
+
+// ======================= Power Config =======================
+// Full clock is only needed while a relay task is timing; between polls the
+// loop blocks until its next deadline so the idle task (or automatic light
+// sleep when the SDK is built with CONFIG_PM_ENABLE) can take over.
+static const bool POWER_SAVE_ENABLED = true;
+static const uint32_t CPU_FREQ_ACTIVE_MHZ = 240;
+static const uint32_t CPU_FREQ_IDLE_MHZ = 80;
+static const uint32_t POWER_LOOP_MAX_SLEEP_MS = 1000;
+// The config API is serviced from loop() and new clients do not wake it, so
+// the wait is capped while it listens. That keeps the loop at 20 wakes/s.
+static const uint32_t POWER_LOOP_CONFIG_API_MAX_WAIT_MS = 50;
+
+// ======================= Time Sync Config =======================
+static const char* SNTP_SERVER_PRIMARY = "pool.ntp.org";
+static const char* SNTP_SERVER_SECONDARY = "time.google.com";
+static const uint32_t SNTP_SYNC_INTERVAL_MS = 900000;
+
+// ======================= Backend TLS Config =======================
+// With TLS on, each task keeps one connection open and reuses it for every
+// poll or invoice, so the handshake is only paid on (re)connect. Pin the
+// server certificate's SHA-256 (hex, ':' separators allowed) to skip CA chain
+// parsing and verification; otherwise BACKEND_TLS_CA_CERT (PEM) is used.
+static const bool BACKEND_TLS_ENABLED = false;
+static const uint16_t BACKEND_TLS_PORT = 8443;
+static const char* BACKEND_TLS_FINGERPRINT = "";
+static const char* BACKEND_TLS_CA_CERT = "";
+static const uint32_t BACKEND_CONNECT_TIMEOUT_MS = 5000;
+static const uint32_t TRANSPORT_REPORT_INTERVAL_MS = 3600000;
+
+// ======================= Backend Failover Config =======================
+// host_ip plus the optional `backends` list form the host pool. Requests go to
+// the healthy host with the lowest RTT EWMA and fail over to the next one on a
+// connect error or 5xx. A host is benched after BACKEND_FAILS_TO_DOWN straight
+// failures, with the cooldown doubling per further failure; once its cooldown
+// expires it is tried again, which is how traffic fails back.
+static const uint8_t BACKEND_MAX_HOSTS = 4;
+static const uint8_t BACKEND_FAILS_TO_DOWN = 2;
+static const uint32_t BACKEND_COOLDOWN_MIN_MS = 10000;
+static const uint32_t BACKEND_COOLDOWN_MAX_MS = 300000;
+static const uint8_t BACKEND_SWITCH_MARGIN_PCT = 25;
+static const uint32_t BACKEND_PROBE_INTERVAL_MS = 300000;
 
 enum NetworkPollType : uint8_t {
   NETWORK_POLL_NONE = 0,
@@ -67,119 +144,364 @@ struct NetworkPollResult {
   int durationSec;
   bool hasCommandId;
   int commandId;
+  uint32_t receivedMs;
   char deviceId[16];
 };
 
 struct PendingCommand {
   uint8_t deviceIndex;
   uint32_t durationMs;
+  int32_t commandId;
+  uint32_t receivedMs;
   char deviceId[16];
 };
 
+// Latency stamps for one command, kept in millis() and only converted to
+// wall-clock time when reported so stamps taken before the first SNTP sync
+// are still usable.
+struct CommandTrace {
+  int32_t commandId;
+  uint32_t receivedMs;
+  uint32_t startedMs;
+  uint32_t finishedMs;
+};
+
+// deviceId is the id the command was polled under, so a device ID changed
+// while the relay ran does not bill the wrong backend device.
 struct InvoiceRequest {
   uint8_t deviceIndex;
+  uint8_t attempts;
+  CommandTrace trace;
+  char deviceId[16];
+};
+
+struct BackendEndpoint {
+  char host[16];
+  uint16_t port;
+};
+
+// rttEwmaMs is 0 until the first successful request has been timed.
+struct BackendHealth {
+  BackendEndpoint endpoint;
+  uint32_t rttEwmaMs;
+  uint8_t consecutiveFailures;
+  uint32_t downUntilMs;
+  uint32_t lastUsedMs;
+  uint32_t successes;
+  uint32_t failures;
+};
+
+// Anti-replay window over backend command_ids: highestId is the newest id
+// accepted and bit N of seenMask marks (highestId - N) as already accepted.
+// Ids older than the window are treated as replays, however old they are; a
+// restarted backend sequence needs an explicit reset (device-ID change or
+// UART dedupe-reset).
+struct CommandDedupeWindow {
+  int32_t highestId;
+  uint32_t seenMask;
 };
 
+static const int32_t COMMAND_DEDUPE_WINDOW = 32;
+
 static QueueHandle_t networkPollQueue = nullptr;
 static TaskHandle_t networkTaskHandle = nullptr;
+static TaskHandle_t loopTaskHandle = nullptr;
 static volatile bool networkPollAllowed = false;
+static volatile bool devicePollAllowed[2] = { true, true };
 
-// ======================= HTTP Helpers =======================
-bool connectWiFi(bool forceConfigPortal = false,
-                 uint32_t portalTimeoutMs = WIFI_CONFIG_PORTAL_TIMEOUT_MS) {
-  WiFi.mode(WIFI_STA);
+// ======================= Runtime Config =======================
+// Loop-task view of the config; safe because the loop task never writes the
+// active slot.
+inline const RuntimeConfig& activeConfig() {
+  return configSlots[activeConfigSlot];
+}
+
+// Consistent copy for other tasks, which may run across several flips.
+inline void snapshotConfig(RuntimeConfig* out) {
+  portENTER_CRITICAL(&configMux);
+  *out = configSlots[activeConfigSlot];
+  portEXIT_CRITICAL(&configMux);
+}
+
+inline const char* configDeviceId(const RuntimeConfig& cfg, uint8_t deviceIndex) {
+  return (deviceIndex == 0) ? cfg.deviceId : cfg.deviceId2;
+}
 
-  WiFiManager wm;
-  wm.setConfigPortalTimeout((uint16_t)(portalTimeoutMs / 1000));
+bool commitConfig(const RuntimeConfig& next, String& errorMsg);
+bool setConfigField(RuntimeConfig* cfg, const char* key, const char* value,
+                    String& errorMsg);
+bool parseBackendList(const RuntimeConfig& cfg, BackendEndpoint* out,
+                      uint8_t* count, String& errorMsg);
+void loadBackendEndpoints(const RuntimeConfig& cfg);
+inline void printBackendHealth(uint32_t now);
+String backendHealthJson(uint32_t now);
+inline void powerWakeLoop();
 
-  WiFiManagerParameter hostParam("host_ip", "Host IP", HOST_IP, sizeof(HOST_IP));
-  WiFiManagerParameter deviceParam("device_id", "Device ID", DEVICE_ID, sizeof(DEVICE_ID));
-  WiFiManagerParameter deviceParam2("device_id_2", "Device ID 2", DEVICE_ID2, sizeof(DEVICE_ID2));
+// ======================= HTTP Helpers =======================
+static WiFiManager wifiManager;
+static WiFiManagerParameter hostParam("host_ip", "Host IP", "",
+                                      sizeof(RuntimeConfig::hostIp));
+static WiFiManagerParameter deviceParam("device_id", "Device ID", "",
+                                        sizeof(RuntimeConfig::deviceId));
+static WiFiManagerParameter deviceParam2("device_id_2", "Device ID 2", "",
+                                         sizeof(RuntimeConfig::deviceId2));
+static WiFiManagerParameter priceParam("price", "Price", "", 16);
+static WiFiManagerParameter invDurParam("inv_duration", "Duration (sec)", "", 12);
+static WiFiManagerParameter descParam("description", "Description", "",
+                                      sizeof(RuntimeConfig::description));
+static WiFiManagerParameter backendsParam("backends", "Backup hosts (ip[:port],...)", "",
+                                          sizeof(RuntimeConfig::backends));
+static bool wifiPortalParamsAdded = false;
+
+// Portal fields start from the live config; empty fields keep their value.
+// Called from the portal task, so it reads a snapshot of the config.
+void refreshPortalParams() {
+  static RuntimeConfig cfg;
+  snapshotConfig(&cfg);
   char priceBuf[16];
-  snprintf(priceBuf, sizeof(priceBuf), "%.2f", PRICE);
+  snprintf(priceBuf, sizeof(priceBuf), "%.2f", cfg.price);
   char durationBuf[12];
-  snprintf(durationBuf, sizeof(durationBuf), "%d", INVOICE_DURATION);
-  WiFiManagerParameter priceParam("price", "Price", priceBuf, sizeof(priceBuf));
-  WiFiManagerParameter invDurParam(NVS_KEY_INV_DURATION, "Duration (sec)", durationBuf, sizeof(durationBuf));
-  WiFiManagerParameter descParam("description", "Description", DESCRIPTION, sizeof(DESCRIPTION));
-  wm.addParameter(&hostParam);
-  wm.addParameter(&deviceParam);
-  wm.addParameter(&deviceParam2);
-  wm.addParameter(&priceParam);
-  wm.addParameter(&invDurParam);
-  wm.addParameter(&descParam);
+  snprintf(durationBuf, sizeof(durationBuf), "%d", cfg.invoiceDurationSec);
+  hostParam.setValue(cfg.hostIp, sizeof(cfg.hostIp));
+  deviceParam.setValue(cfg.deviceId, sizeof(cfg.deviceId));
+  deviceParam2.setValue(cfg.deviceId2, sizeof(cfg.deviceId2));
+  priceParam.setValue(priceBuf, sizeof(priceBuf));
+  invDurParam.setValue(durationBuf, sizeof(durationBuf));
+  descParam.setValue(cfg.description, sizeof(cfg.description));
+  backendsParam.setValue(cfg.backends, sizeof(cfg.backends));
+}
 
-  bool ok = false;
-  if (forceConfigPortal) {
-    ok = wm.startConfigPortal("Scanpay-Setup");
-  } else {
-    ok = wm.autoConnect("Scanpay-Setup");
-  }
-  if (!ok) {
-    return false;
+static WiFiManagerParameter* const portalParams[] = {
+  &hostParam, &deviceParam, &deviceParam2, &priceParam, &invDurParam, &descParam,
+  &backendsParam
+};
+static const char* const portalParamKeys[] = {
+  "host_ip", "device_id", "device_id_2", "price", NVS_KEY_INV_DURATION, "description",
+  "backends"
+};
+static const uint8_t PORTAL_PARAM_COUNT = sizeof(portalParams) / sizeof(portalParams[0]);
+static char portalSavedValues[PORTAL_PARAM_COUNT][sizeof(RuntimeConfig::backends)];
+static portMUX_TYPE portalMux = portMUX_INITIALIZER_UNLOCKED;
+static volatile bool portalSavePending = false;
+static TaskHandle_t portalTaskHandle = nullptr;
+
+// Save callback, on whichever task runs WiFiManager: copy the submitted
+// fields so loop() can apply them with applyPortalParams().
+void stagePortalParams() {
+  portENTER_CRITICAL(&portalMux);
+  for (uint8_t i = 0; i < PORTAL_PARAM_COUNT; i++) {
+    const char* value = portalParams[i]->getValue();
+    strncpy(portalSavedValues[i], value ? value : "", sizeof(portalSavedValues[i]));
+    portalSavedValues[i][sizeof(portalSavedValues[i]) - 1] = '\0';
   }
+  portalSavePending = true;
+  portEXIT_CRITICAL(&portalMux);
+  powerWakeLoop();
+}
 
-  const char* hostVal = hostParam.getValue();
-  if (hostVal && hostVal[0] != '\0') {
-    strncpy(HOST_IP, hostVal, sizeof(HOST_IP));
-    HOST_IP[sizeof(HOST_IP) - 1] = '\0';
-  }
+void applyPortalParams() {
+  if (!portalSavePending) return;
+  char values[PORTAL_PARAM_COUNT][sizeof(RuntimeConfig::backends)];
+  portENTER_CRITICAL(&portalMux);
+  memcpy(values, portalSavedValues, sizeof(values));
+  portalSavePending = false;
+  portEXIT_CRITICAL(&portalMux);
 
-  const char* deviceVal = deviceParam.getValue();
-  if (deviceVal && deviceVal[0] != '\0') {
-    strncpy(DEVICE_ID, deviceVal, sizeof(DEVICE_ID));
-    DEVICE_ID[sizeof(DEVICE_ID) - 1] = '\0';
+  RuntimeConfig next = activeConfig();
+  String errorMsg;
+  for (uint8_t i = 0; i < PORTAL_PARAM_COUNT; i++) {
+    if (values[i][0] == '\0') continue;
+    if (!setConfigField(&next, portalParamKeys[i], values[i], errorMsg)) {
+      Serial.println("CFG ERR " + errorMsg);
+      return;
+    }
   }
-
-  const char* deviceVal2 = deviceParam2.getValue();
-  if (deviceVal2 && deviceVal2[0] != '\0') {
-    strncpy(DEVICE_ID2, deviceVal2, sizeof(DEVICE_ID2));
-    DEVICE_ID2[sizeof(DEVICE_ID2) - 1] = '\0';
+  if (!commitConfig(next, errorMsg)) {
+    Serial.println("CFG ERR " + errorMsg);
   }
+}
 
-  const char* priceVal = priceParam.getValue();
-  if (priceVal && priceVal[0] != '\0') {
-    PRICE = (float)atof(priceVal);
+void setupWiFiPortal(uint32_t portalTimeoutMs) {
+  wifiManager.setConfigPortalTimeout((uint16_t)(portalTimeoutMs / 1000));
+  if (wifiPortalParamsAdded) return;
+  wifiPortalParamsAdded = true;
+  for (uint8_t i = 0; i < PORTAL_PARAM_COUNT; i++) {
+    wifiManager.addParameter(portalParams[i]);
   }
+  wifiManager.setSaveParamsCallback(stagePortalParams);
+}
 
-  const char* invDurVal = invDurParam.getValue();
-  if (invDurVal && invDurVal[0] != '\0') {
-    INVOICE_DURATION = atoi(invDurVal);
-  }
+// Blocking connect used at boot, before any relay task can be running.
+bool connectWiFi(bool forceConfigPortal = false,
+                 uint32_t portalTimeoutMs = WIFI_CONFIG_PORTAL_TIMEOUT_MS) {
+  WiFi.mode(WIFI_STA);
 
-  const char* descVal = descParam.getValue();
-  if (descVal && descVal[0] != '\0') {
-    strncpy(DESCRIPTION, descVal, sizeof(DESCRIPTION));
-    DESCRIPTION[sizeof(DESCRIPTION) - 1] = '\0';
+  setupWiFiPortal(portalTimeoutMs);
+  refreshPortalParams();
+  wifiManager.setConfigPortalBlocking(true);
+
+  bool connected = forceConfigPortal ? wifiManager.startConfigPortal("Scanpay-Setup")
+                                     : wifiManager.autoConnect("Scanpay-Setup");
+  applyPortalParams();
+  return connected;
+}
+
+// Runtime portal opened from WIFI_CONFIG_PIN. WiFiManager blocks inside
+// startConfigPortal() while the AP comes up and inside process() after a save
+// (close delay, then a synchronous reconnect), so it runs on its own task and
+// never holds up relay edges. Saved fields are applied by loop(), and Wi-Fi
+// reconnects in the background once the portal closes.
+void portalTask(void* parameter) {
+  (void)parameter;
+  for (;;) {
+    (void)ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    setupWiFiPortal(WIFI_CONFIG_PORTAL_TIMEOUT_MS);
+    refreshPortalParams();
+    wifiManager.setConfigPortalBlocking(false);
+    wifiManager.setSaveConnect(false);
+    wifiManager.setConnectTimeout((uint16_t)(WIFI_PORTAL_CONNECT_TIMEOUT_MS / 1000));
+    (void)wifiManager.startConfigPortal("Scanpay-Setup");
+    while (wifiManager.getConfigPortalActive()) {
+      (void)wifiManager.process();
+      vTaskDelay(pdMS_TO_TICKS(WIFI_PORTAL_PROCESS_INTERVAL_MS));
+    }
+    if (WiFi.status() != WL_CONNECTED) {
+      WiFi.begin();
+    }
   }
+}
 
-  return true;
+inline void startWiFiPortal() {
+  if (portalTaskHandle != nullptr) {
+    xTaskNotifyGive(portalTaskHandle);
+  }
 }
 
 void loadPrefs() {
   if (!prefs.begin(NVS_NS, true)) {
     return;
   }
-  prefs.getString("host_ip", HOST_IP, sizeof(HOST_IP));
-  prefs.getString("device_id", DEVICE_ID, sizeof(DEVICE_ID));
-  prefs.getString("device_id_2", DEVICE_ID2, sizeof(DEVICE_ID2));
-  PRICE = prefs.getFloat("price", PRICE);
-  INVOICE_DURATION = prefs.getInt(NVS_KEY_INV_DURATION, INVOICE_DURATION);
-  prefs.getString("description", DESCRIPTION, sizeof(DESCRIPTION));
+  RuntimeConfig& cfg = configSlots[activeConfigSlot];
+  prefs.getString("host_ip", cfg.hostIp, sizeof(cfg.hostIp));
+  prefs.getString("device_id", cfg.deviceId, sizeof(cfg.deviceId));
+  prefs.getString("device_id_2", cfg.deviceId2, sizeof(cfg.deviceId2));
+  cfg.price = prefs.getFloat("price", cfg.price);
+  cfg.invoiceDurationSec = prefs.getInt(NVS_KEY_INV_DURATION, cfg.invoiceDurationSec);
+  prefs.getString("description", cfg.description, sizeof(cfg.description));
+  prefs.getString("backends", cfg.backends, sizeof(cfg.backends));
   prefs.end();
 }
 
-void savePrefs() {
-  if (!prefs.begin(NVS_NS, false)) {
+// Called from the network task so NVS writes never stall the loop. Uses its
+// own Preferences handle because the loop task owns `prefs`.
+void persistConfigIfPending() {
+  if (!configPersistPending) return;
+  configPersistPending = false;
+  RuntimeConfig cfg;
+  snapshotConfig(&cfg);
+  Preferences store;
+  if (!store.begin(NVS_NS, false)) {
+    configPersistPending = true;
     return;
   }
-  prefs.putString("host_ip", HOST_IP);
-  prefs.putString("device_id", DEVICE_ID);
-  prefs.putString("device_id_2", DEVICE_ID2);
-  prefs.putFloat("price", PRICE);
-  prefs.putInt(NVS_KEY_INV_DURATION, INVOICE_DURATION);
-  prefs.putString("description", DESCRIPTION);
-  prefs.end();
+  store.putString("host_ip", cfg.hostIp);
+  store.putString("device_id", cfg.deviceId);
+  store.putString("device_id_2", cfg.deviceId2);
+  store.putFloat("price", cfg.price);
+  store.putInt(NVS_KEY_INV_DURATION, cfg.invoiceDurationSec);
+  store.putString("description", cfg.description);
+  store.putString("backends", cfg.backends);
+  store.end();
+}
+
+// ======================= Time Sync =======================
+static portMUX_TYPE timeSyncMux = portMUX_INITIALIZER_UNLOCKED;
+static bool timeSynced = false;
+static int64_t clockOffsetMs = 0;
+static int64_t clockStepMs = 0;
+static volatile uint32_t timeSyncCount = 0;
+static uint32_t timeSyncReported = 0;
+
+// Runs in the SNTP/lwIP task. The offset maps esp_timer (and so millis())
+// onto wall-clock time; the step is how far the clock moved since the
+// previous sync.
+void onTimeSync(struct timeval* tv) {
+  if (!tv) return;
+  int64_t wallMs = (int64_t)tv->tv_sec * 1000 + tv->tv_usec / 1000;
+  int64_t offsetMs = wallMs - esp_timer_get_time() / 1000;
+  portENTER_CRITICAL(&timeSyncMux);
+  clockStepMs = timeSynced ? (offsetMs - clockOffsetMs) : 0;
+  clockOffsetMs = offsetMs;
+  timeSynced = true;
+  portEXIT_CRITICAL(&timeSyncMux);
+  timeSyncCount++;
+}
+
+void beginTimeSync() {
+  sntp_set_time_sync_notification_cb(onTimeSync);
+  sntp_set_sync_interval(SNTP_SYNC_INTERVAL_MS);
+  configTime(0, 0, SNTP_SERVER_PRIMARY, SNTP_SERVER_SECONDARY);
+}
+
+// Wall-clock epoch ms for a millis() stamp, or 0 before the first sync.
+inline int64_t wallClockMs(uint32_t stampMs) {
+  portENTER_CRITICAL(&timeSyncMux);
+  bool synced = timeSynced;
+  int64_t offsetMs = clockOffsetMs;
+  portEXIT_CRITICAL(&timeSyncMux);
+  if (!synced) return 0;
+  int64_t monoMs = esp_timer_get_time() / 1000 - (int32_t)(millis() - stampMs);
+  return monoMs + offsetMs;
+}
+
+inline void reportTimeSync() {
+  uint32_t count = timeSyncCount;
+  if (count == timeSyncReported) return;
+  timeSyncReported = count;
+  portENTER_CRITICAL(&timeSyncMux);
+  int64_t stepMs = clockStepMs;
+  portEXIT_CRITICAL(&timeSyncMux);
+  Serial.print("N ");
+  Serial.print(count);
+  Serial.print(" d");
+  Serial.println((long)stepMs);
+}
+
+// Extra invoice body fields so the backend can tie the invoice to the command
+// that caused it and compare against its own timestamps.
+inline String traceJsonFields(const CommandTrace& trace) {
+  String fields;
+  if (trace.commandId >= 0) {
+    fields += ",\"command_id\":" + String(trace.commandId);
+  }
+  int64_t receivedAt = wallClockMs(trace.receivedMs);
+  if (receivedAt > 0) {
+    fields += ",\"received_at_ms\":" + String((long long)receivedAt) +
+              ",\"started_at_ms\":" +
+              String((long long)wallClockMs(trace.startedMs)) +
+              ",\"finished_at_ms\":" +
+              String((long long)wallClockMs(trace.finishedMs));
+  }
+  return fields;
+}
+
+// One UART line per acknowledged invoice:
+//   L <device_id> c<command_id> t<received epoch ms> s<start> f<finish> a<ack>
+// with start/finish/ack in ms after the command was received.
+inline void reportCommandLatency(const char* deviceId, const CommandTrace& trace,
+                                 uint32_t ackMs) {
+  Serial.print("L ");
+  Serial.print(deviceId);
+  Serial.print(" c");
+  Serial.print(trace.commandId);
+  Serial.print(" t");
+  Serial.print((long long)wallClockMs(trace.receivedMs));
+  Serial.print(" s");
+  Serial.print(trace.startedMs - trace.receivedMs);
+  Serial.print(" f");
+  Serial.print(trace.finishedMs - trace.receivedMs);
+  Serial.print(" a");
+  Serial.println(ackMs - trace.receivedMs);
 }
 
 // ======================= Relay & Opto Function ====================
@@ -227,22 +549,57 @@ static uint32_t pulseEdgeMs[RELAY_CHANNEL_COUNT] = { 0, 0 };
 static uint32_t relayCooldownUntilMs[RELAY_CHANNEL_COUNT] = { 0, 0 };
 static uint32_t relayWatchdogUntilMs[RELAY_CHANNEL_COUNT] = { 0, 0 };
 static int8_t relayDeviceIndex[RELAY_CHANNEL_COUNT] = { -1, -1 };
+static CommandTrace relayTrace[RELAY_CHANNEL_COUNT];
+static char relayDeviceId[RELAY_CHANNEL_COUNT][16];
+static int64_t relayHoldUntilUs[RELAY_CHANNEL_COUNT] = { 0, 0 };
 static RelayPhase relayPhase[RELAY_CHANNEL_COUNT] = {
   RELAY_PHASE_IDLE, RELAY_PHASE_IDLE
 };
-static PendingCommand pendingCommands[RELAY_CHANNEL_COUNT];
-static uint8_t pendingCommandHead = 0;
-static uint8_t pendingCommandTail = 0;
+// Per-device FIFO of accepted commands; the next entry starts as soon as the
+// device's mapped relay frees up.
+static PendingCommand pendingCommands[2][PENDING_COMMANDS_PER_DEVICE];
+static uint8_t pendingCommandHead[2] = { 0, 0 };
+static uint8_t pendingCommandDeviceCount[2] = { 0, 0 };
 static uint8_t pendingCommandCount = 0;
 static InvoiceRequest pendingInvoices[RELAY_CHANNEL_COUNT * 2];
 static uint8_t pendingInvoiceHead = 0;
 static uint8_t pendingInvoiceTail = 0;
 static uint8_t pendingInvoiceCount = 0;
+
+// Invoice sends run in the network task so a slow backend cannot stall relay
+// timing. loop() hands over one job at a time and keeps a copy, so its entries
+// still hold back their device's next command until the result comes back.
+struct InvoiceJob {
+  uint8_t count;
+  InvoiceRequest items[RELAY_CHANNEL_COUNT * 2];
+  char amount[16];
+  uint32_t durationSec;
+};
+
+struct InvoiceJobResult {
+  bool itemOk[RELAY_CHANNEL_COUNT * 2];
+  bool batchUnsupported;
+  uint32_t ackMs;
+};
+
+static QueueHandle_t invoiceJobQueue = nullptr;
+static QueueHandle_t invoiceResultQueue = nullptr;
+static InvoiceJob invoiceJobInFlight;
+static bool invoiceJobBusy = false;
 static uint8_t activeTaskCount[2] = { 0, 0 };
 static uint32_t lastInvoiceAttemptMs = 0;
+static bool invoiceBatchSupported = INVOICE_BATCH_ENABLED;
+static uint32_t invoiceBatchRetryAtMs = 0;
 static uint32_t lastPollMs = 0;
 static uint32_t lastStatusMs = 0;
-static int lastCommandId[2] = { -1, -1 };
+static CommandDedupeWindow commandDedupe[2] = { { -1, 0 }, { -1, 0 } };
+static int32_t lastRejectedCommandId[2] = { -1, -1 };
+static bool commandDedupeDirty = false;
+// Copy of commandDedupe handed to the network task for the NVS write.
+static portMUX_TYPE commandDedupeMux = portMUX_INITIALIZER_UNLOCKED;
+static CommandDedupeWindow commandDedupeStaged[2];
+static volatile bool commandDedupePersistPending = false;
+static uint32_t droppedCommandCount = 0;
 static bool wifiConfigPinWasActive = false;
 
 inline bool timeReached(uint32_t now, uint32_t target) {
@@ -251,34 +608,58 @@ inline bool timeReached(uint32_t now, uint32_t target) {
 
 inline bool hasPendingCommands();
 inline bool enqueuePendingCommand(uint8_t deviceIndex, uint32_t durationMs,
-                                  const char* deviceId);
-inline bool dequeuePendingCommand(PendingCommand* out);
+                                  const char* deviceId, int32_t commandId,
+                                  uint32_t receivedMs);
+inline bool dequeuePendingCommand(uint8_t deviceIndex, PendingCommand* out);
 inline void cancelPendingCommandsForDevice(uint8_t deviceIndex);
 inline bool hasPendingCommandForDevice(uint8_t deviceIndex);
 inline bool channelAvailable(uint8_t ch, uint32_t now);
 inline int8_t relayChannelForDevice(uint8_t deviceIndex);
 inline void processPendingCommands(uint32_t now);
 inline void startRelayPulse(uint8_t ch, uint32_t onMs, uint32_t now,
-                            uint8_t deviceIndex);
-inline bool enqueueInvoiceRequest(uint8_t deviceIndex);
+                            uint8_t deviceIndex, const char* deviceId,
+                            int32_t commandId, uint32_t receivedMs);
+inline bool commandIdSeen(uint8_t deviceIndex, int32_t commandId);
+inline void logRejectedCommandId(uint8_t deviceIndex, int32_t commandId);
+inline void recordCommandId(uint8_t deviceIndex, int32_t commandId);
+inline bool commandIdInFlight(uint8_t deviceIndex, int32_t commandId);
+inline bool enqueueInvoiceRequest(const InvoiceRequest& req);
+inline bool hasFreshInvoiceRequestForDevice(uint8_t deviceIndex);
 inline bool peekInvoiceRequest(InvoiceRequest* out);
 inline void popInvoiceRequest();
 inline bool dequeueInvoiceRequestAt(uint8_t offset, InvoiceRequest* out);
+inline void checkpointRelay(uint8_t ch, bool toFlash = false);
+inline int64_t systemTimeUs();
 bool requestInvoice(
-  const char* serverIp,
   const char* deviceId,
   const char* amount,
   uint32_t durationSec,
+  const CommandTrace& trace,
   String& invoiceId,
   String& payUrl,
   String& errorMsg
 );
+bool requestInvoiceBatch(
+  const InvoiceRequest* reqs,
+  uint8_t count,
+  const char* amount,
+  uint32_t durationSec,
+  bool* itemOk,
+  bool* unsupported,
+  String& errorMsg
+);
+inline uint8_t takeReadyInvoiceRequests(uint32_t now, InvoiceRequest* out,
+                                        uint8_t maxCount);
 inline void processInvoiceRequests(uint32_t now);
 inline void logBlockedCommand(const NetworkPollResult& result, uint32_t now);
 
 inline bool jsonHas(const String& body, const char* key, const char* value) {
-  String needle = String("\"") + key + "\":" + value;
-  return body.indexOf(needle) >= 0;
+  String needle = String("\"") + key + "\":";
+  int idx = body.indexOf(needle);
+  if (idx < 0) return false;
+  idx += needle.length();
+  while (idx < (int)body.length() && (body[idx] == ' ' || body[idx] == '\t')) idx++;
+  return strncmp(body.c_str() + idx, value, strlen(value)) == 0;
 }
 
 inline bool jsonInt(const String& body, const char* key, int* out) {
@@ -317,6 +698,7 @@ inline bool parseHttpBody(const String& body, uint8_t deviceIndex,
   out->durationSec = 0;
   out->hasCommandId = false;
   out->commandId = -1;
+  out->receivedMs = millis();
   strncpy(out->deviceId, deviceId, sizeof(out->deviceId));
   out->deviceId[sizeof(out->deviceId) - 1] = '\0';
 
@@ -347,36 +729,45 @@ inline void applyNetworkPollResult(const NetworkPollResult& result) {
   if (result.deviceIndex > 1 || result.type == NETWORK_POLL_NONE) return;
   if (result.type == NETWORK_POLL_NO_COMMAND) {
     // "No command" means no new work from backend.
-    // Keep local action/duration state so an in-progress cycle can finish
-    // and trigger invoice generation.
-    cancelPendingCommandsForDevice(result.deviceIndex);
+    // Commands already accepted into the device FIFO stay queued so they can
+    // run back-to-back and trigger invoice generation.
     return;
   }
 
   if (result.type == NETWORK_POLL_COMMAND) {
     uint32_t now = millis();
-    int8_t mappedRelay = relayChannelForDevice(result.deviceIndex);
-    if (result.hasCommandId &&
-        lastCommandId[result.deviceIndex] == result.commandId) {
-      // Duplicate command from backend poll, ignore restart.
+    if (result.hasCommandId && commandIdSeen(result.deviceIndex, result.commandId)) {
+      // Replayed command from backend poll, ignore restart.
+      logRejectedCommandId(result.deviceIndex, result.commandId);
       return;
     }
-    if (result.action &&
-        (mappedRelay < 0 ||
-         hasPendingCommandForDevice(result.deviceIndex) ||
-         !channelAvailable((uint8_t)mappedRelay, now))) {
-      logBlockedCommand(result, now);
+    if (result.hasCommandId && commandIdInFlight(result.deviceIndex, result.commandId)) {
+      // Still queued or running, the backend served it again.
       return;
     }
-    if (result.action &&
-        !enqueuePendingCommand(result.deviceIndex,
-                               (uint32_t)result.durationSec * 1000U,
-                               result.deviceId)) {
+    // Commands without a command_id cannot be deduped, so they are only
+    // accepted while the device has nothing queued and its relay is free.
+    if (!result.action) {
+      // Backend withdrew work for this device, drop anything not yet started.
+      cancelPendingCommandsForDevice(result.deviceIndex);
+    } else if (relayChannelForDevice(result.deviceIndex) < 0 ||
+               (!result.hasCommandId &&
+                (hasPendingCommandForDevice(result.deviceIndex) ||
+                 !channelAvailable((uint8_t)result.deviceIndex, now)))) {
+      // Refused, not dropped: nothing was taken from the backend's queue.
+      return;
+    } else if (!enqueuePendingCommand(result.deviceIndex,
+                                      (uint32_t)result.durationSec * 1000U,
+                                      result.deviceId,
+                                      result.hasCommandId ? result.commandId : -1,
+                                      result.receivedMs)) {
       logBlockedCommand(result, now);
       return;
     }
-    if (result.hasCommandId) {
-      lastCommandId[result.deviceIndex] = result.commandId;
+    // Started commands are recorded by processPendingCommands(); recording
+    // at accept time would lose queued commands to the window on a reset.
+    if (!result.action && result.hasCommandId) {
+      recordCommandId(result.deviceIndex, result.commandId);
     }
     strncpy(ACTIVE_DEVICE_ID, result.deviceId, sizeof(ACTIVE_DEVICE_ID));
     ACTIVE_DEVICE_ID[sizeof(ACTIVE_DEVICE_ID) - 1] = '\0';
@@ -408,72 +799,492 @@ inline bool hasPendingCommands() {
 }
 
 inline bool enqueuePendingCommand(uint8_t deviceIndex, uint32_t durationMs,
-                                  const char* deviceId) {
-  if (pendingCommandCount >= RELAY_CHANNEL_COUNT) return false;
-  PendingCommand& cmd = pendingCommands[pendingCommandTail];
+                                  const char* deviceId, int32_t commandId,
+                                  uint32_t receivedMs) {
+  if (deviceIndex > 1 ||
+      pendingCommandDeviceCount[deviceIndex] >= PENDING_COMMANDS_PER_DEVICE) {
+    return false;
+  }
+  uint8_t tail = (uint8_t)((pendingCommandHead[deviceIndex] +
+                            pendingCommandDeviceCount[deviceIndex]) %
+                           PENDING_COMMANDS_PER_DEVICE);
+  PendingCommand& cmd = pendingCommands[deviceIndex][tail];
   cmd.deviceIndex = deviceIndex;
   cmd.durationMs = durationMs;
+  cmd.commandId = commandId;
+  cmd.receivedMs = receivedMs;
   strncpy(cmd.deviceId, deviceId, sizeof(cmd.deviceId));
   cmd.deviceId[sizeof(cmd.deviceId) - 1] = '\0';
-  pendingCommandTail = (uint8_t)((pendingCommandTail + 1) % RELAY_CHANNEL_COUNT);
+  pendingCommandDeviceCount[deviceIndex]++;
   pendingCommandCount++;
   return true;
 }
 
-inline bool dequeuePendingCommand(PendingCommand* out) {
-  if (!out || pendingCommandCount == 0) return false;
-  *out = pendingCommands[pendingCommandHead];
-  pendingCommandHead = (uint8_t)((pendingCommandHead + 1) % RELAY_CHANNEL_COUNT);
+inline bool dequeuePendingCommand(uint8_t deviceIndex, PendingCommand* out) {
+  if (!out || deviceIndex > 1 || pendingCommandDeviceCount[deviceIndex] == 0) {
+    return false;
+  }
+  *out = pendingCommands[deviceIndex][pendingCommandHead[deviceIndex]];
+  pendingCommandHead[deviceIndex] =
+    (uint8_t)((pendingCommandHead[deviceIndex] + 1) % PENDING_COMMANDS_PER_DEVICE);
+  pendingCommandDeviceCount[deviceIndex]--;
   pendingCommandCount--;
   return true;
 }
 
 inline void cancelPendingCommandsForDevice(uint8_t deviceIndex) {
-  if (pendingCommandCount == 0) return;
-  PendingCommand kept[RELAY_CHANNEL_COUNT];
-  uint8_t keptCount = 0;
-  while (pendingCommandCount > 0) {
-    PendingCommand cmd;
-    (void)dequeuePendingCommand(&cmd);
-    if (cmd.deviceIndex != deviceIndex) {
-      kept[keptCount++] = cmd;
+  if (deviceIndex > 1) return;
+  pendingCommandCount -= pendingCommandDeviceCount[deviceIndex];
+  pendingCommandHead[deviceIndex] = 0;
+  pendingCommandDeviceCount[deviceIndex] = 0;
+}
+
+inline bool hasPendingCommandForDevice(uint8_t deviceIndex) {
+  if (deviceIndex > 1) return false;
+  return pendingCommandDeviceCount[deviceIndex] > 0;
+}
+
+// Only a full device FIFO lands here; that is what the X status field counts.
+inline void logBlockedCommand(const NetworkPollResult& result, uint32_t now) {
+  (void)result;
+  (void)now;
+  // The command_id is not recorded, so the backend can serve it again once
+  // the device FIFO has room.
+  droppedCommandCount++;
+}
+
+inline bool commandIdSeen(uint8_t deviceIndex, int32_t commandId) {
+  if (deviceIndex > 1) return false;
+  const CommandDedupeWindow& w = commandDedupe[deviceIndex];
+  if (w.highestId < 0 || commandId > w.highestId) return false;
+  int32_t age = w.highestId - commandId;
+  if (age >= COMMAND_DEDUPE_WINDOW) return true;
+  return (w.seenMask & (1UL << age)) != 0;
+}
+
+// "D <device> x<command_id>", once per id so a replaying backend does not
+// flood the UART.
+inline void logRejectedCommandId(uint8_t deviceIndex, int32_t commandId) {
+  if (deviceIndex > 1 || lastRejectedCommandId[deviceIndex] == commandId) return;
+  lastRejectedCommandId[deviceIndex] = commandId;
+  Serial.print("D ");
+  Serial.print(deviceIndex);
+  Serial.print(" x");
+  Serial.println(commandId);
+}
+
+inline void resetCommandDedupe(uint8_t deviceIndex) {
+  if (deviceIndex > 1) return;
+  commandDedupe[deviceIndex].highestId = -1;
+  commandDedupe[deviceIndex].seenMask = 0;
+  lastRejectedCommandId[deviceIndex] = -1;
+  commandDedupeDirty = true;
+}
+
+// Queued or running commands are not in the persisted window yet.
+inline bool commandIdInFlight(uint8_t deviceIndex, int32_t commandId) {
+  if (deviceIndex > 1) return false;
+  for (uint8_t i = 0; i < pendingCommandDeviceCount[deviceIndex]; i++) {
+    uint8_t idx = (uint8_t)((pendingCommandHead[deviceIndex] + i) %
+                            PENDING_COMMANDS_PER_DEVICE);
+    if (pendingCommands[deviceIndex][idx].commandId == commandId) return true;
+  }
+  int8_t ch = relayChannelForDevice(deviceIndex);
+  return ch >= 0 && relayState[ch] && relayTrace[ch].commandId == commandId;
+}
+
+inline void recordCommandId(uint8_t deviceIndex, int32_t commandId) {
+  if (deviceIndex > 1 || commandId < 0) return;
+  CommandDedupeWindow& w = commandDedupe[deviceIndex];
+  if (w.highestId < 0 || commandId > w.highestId) {
+    int32_t shift = (w.highestId < 0) ? COMMAND_DEDUPE_WINDOW
+                                      : commandId - w.highestId;
+    w.seenMask = (shift >= COMMAND_DEDUPE_WINDOW) ? 0 : (w.seenMask << shift);
+    w.seenMask |= 1UL;
+    w.highestId = commandId;
+  } else {
+    int32_t age = w.highestId - commandId;
+    if (age >= COMMAND_DEDUPE_WINDOW) return;
+    w.seenMask |= (1UL << age);
+  }
+  commandDedupeDirty = true;
+}
+
+void loadCommandDedupe() {
+  if (!prefs.begin(NVS_NS, true)) {
+    return;
+  }
+  CommandDedupeWindow stored[2];
+  if (prefs.getBytes(NVS_KEY_CMD_DEDUPE, stored, sizeof(stored)) == sizeof(stored)) {
+    memcpy(commandDedupe, stored, sizeof(commandDedupe));
+  }
+  prefs.end();
+}
+
+// Loop side: only copies the window, the write happens on the network task.
+inline void stageCommandDedupe() {
+  if (!commandDedupeDirty) return;
+  commandDedupeDirty = false;
+  portENTER_CRITICAL(&commandDedupeMux);
+  memcpy(commandDedupeStaged, commandDedupe, sizeof(commandDedupeStaged));
+  portEXIT_CRITICAL(&commandDedupeMux);
+  commandDedupePersistPending = true;
+}
+
+// Called from the network task, like persistConfigIfPending(). 16 bytes per
+// write, and only after a command was accepted.
+void persistCommandDedupeIfPending() {
+  if (!commandDedupePersistPending) return;
+  commandDedupePersistPending = false;
+  CommandDedupeWindow staged[2];
+  portENTER_CRITICAL(&commandDedupeMux);
+  memcpy(staged, commandDedupeStaged, sizeof(staged));
+  portEXIT_CRITICAL(&commandDedupeMux);
+  Preferences store;
+  if (!store.begin(NVS_NS, false)) {
+    commandDedupePersistPending = true;
+    return;
+  }
+  store.putBytes(NVS_KEY_CMD_DEDUPE, staged, sizeof(staged));
+  store.end();
+}
+
+// ======================= Live Config =======================
+// Changes arrive from the portal, POST /config on CONFIG_API_PORT or UART.
+// Each source edits a copy of the active config, and commitConfig() validates
+// the whole copy before swapping it in.
+static WebServer configServer(CONFIG_API_PORT);
+static bool configServerStarted = false;
+static RuntimeConfig uartStagedConfig;
+static bool uartStagedDirty = false;
+static char uartLine[UART_COMMAND_MAX_LEN];
+static size_t uartLineLen = 0;
+
+inline bool copyConfigString(char* dst, size_t dstSize, const char* value,
+                             bool allowSpaces, String& errorMsg) {
+  size_t len = strlen(value);
+  if (len == 0 || len >= dstSize) {
+    errorMsg = "length must be 1.." + String((unsigned)(dstSize - 1));
+    return false;
+  }
+  for (size_t i = 0; i < len; i++) {
+    char c = value[i];
+    bool ok = isalnum((unsigned char)c) || c == '-' || c == '_' || c == '.' ||
+              (allowSpaces && c >= ' ' && c <= '~' && c != '"' && c != '\\');
+    if (!ok) {
+      errorMsg = "invalid character";
+      return false;
     }
   }
-  pendingCommandHead = 0;
-  pendingCommandTail = 0;
-  pendingCommandCount = 0;
-  for (uint8_t i = 0; i < keptCount; i++) {
-    (void)enqueuePendingCommand(kept[i].deviceIndex, kept[i].durationMs,
-                                kept[i].deviceId);
+  memcpy(dst, value, len + 1);
+  return true;
+}
+
+bool setConfigField(RuntimeConfig* cfg, const char* key, const char* value,
+                    String& errorMsg) {
+  if (!cfg || !key || !value) {
+    errorMsg = "missing key or value";
+    return false;
+  }
+  bool ok = false;
+  String fieldError;
+  if (strcmp(key, "host_ip") == 0) {
+    IPAddress ip;
+    ok = ip.fromString(value) &&
+         copyConfigString(cfg->hostIp, sizeof(cfg->hostIp), value, false, fieldError);
+    if (!ok && fieldError.isEmpty()) fieldError = "not an IPv4 address";
+  } else if (strcmp(key, "device_id") == 0) {
+    ok = copyConfigString(cfg->deviceId, sizeof(cfg->deviceId), value, false, fieldError);
+  } else if (strcmp(key, "device_id_2") == 0) {
+    ok = copyConfigString(cfg->deviceId2, sizeof(cfg->deviceId2), value, false, fieldError);
+  } else if (strcmp(key, "price") == 0) {
+    char* end = nullptr;
+    float price = strtof(value, &end);
+    ok = end != value && *end == '\0' && price > 0.0f && price < 100000.0f;
+    if (ok) cfg->price = price;
+    else fieldError = "must be > 0 and < 100000";
+  } else if (strcmp(key, NVS_KEY_INV_DURATION) == 0) {
+    char* end = nullptr;
+    long duration = strtol(value, &end, 10);
+    ok = end != value && *end == '\0' && duration >= 1 && duration <= 86400;
+    if (ok) cfg->invoiceDurationSec = (int)duration;
+    else fieldError = "must be 1..86400";
+  } else if (strcmp(key, "description") == 0) {
+    ok = copyConfigString(cfg->description, sizeof(cfg->description), value, true,
+                          fieldError);
+  } else if (strcmp(key, "backends") == 0) {
+    // "none" clears the list, since UART `set` needs a value.
+    if (strcmp(value, "none") == 0) value = "";
+    size_t len = strlen(value);
+    RuntimeConfig probe = *cfg;
+    BackendEndpoint endpoints[BACKEND_MAX_HOSTS];
+    uint8_t count = 0;
+    if (len >= sizeof(probe.backends)) {
+      fieldError = "length must be 0.." + String((unsigned)(sizeof(probe.backends) - 1));
+    } else {
+      memcpy(probe.backends, value, len + 1);
+      ok = parseBackendList(probe, endpoints, &count, fieldError);
+    }
+    if (ok) memcpy(cfg->backends, probe.backends, sizeof(cfg->backends));
+  } else {
+    fieldError = "unknown key";
+  }
+  if (!ok) {
+    errorMsg = String(key) + ": " + fieldError;
   }
+  return ok;
 }
 
-inline bool hasPendingCommandForDevice(uint8_t deviceIndex) {
-  if (pendingCommandCount == 0) return false;
-  uint8_t idx = pendingCommandHead;
-  for (uint8_t i = 0; i < pendingCommandCount; i++) {
-    if (pendingCommands[idx].deviceIndex == deviceIndex) {
-      return true;
+bool commitConfig(const RuntimeConfig& next, String& errorMsg) {
+  if (strcmp(next.deviceId, next.deviceId2) == 0) {
+    errorMsg = "device_id and device_id_2 must differ";
+    return false;
+  }
+  BackendEndpoint endpoints[BACKEND_MAX_HOSTS];
+  uint8_t endpointCount = 0;
+  if (!parseBackendList(next, endpoints, &endpointCount, errorMsg)) {
+    errorMsg = "backends: " + errorMsg;
+    return false;
+  }
+  const RuntimeConfig& current = activeConfig();
+  bool hostsChanged = strcmp(current.hostIp, next.hostIp) != 0 ||
+                      strcmp(current.backends, next.backends) != 0;
+  // Dedupe windows track the backend's ids for one device; a new device id
+  // starts a fresh sequence.
+  for (uint8_t i = 0; i < 2; i++) {
+    if (strcmp(configDeviceId(current, i), configDeviceId(next, i)) != 0) {
+      resetCommandDedupe(i);
     }
-    idx = (uint8_t)((idx + 1) % RELAY_CHANNEL_COUNT);
   }
-  return false;
+  uint8_t staging = (uint8_t)(activeConfigSlot ^ 1);
+  configSlots[staging] = next;
+  portENTER_CRITICAL(&configMux);
+  activeConfigSlot = staging;
+  portEXIT_CRITICAL(&configMux);
+  configPersistPending = true;
+  if (hostsChanged) {
+    loadBackendEndpoints(next);
+  }
+  errorMsg = "";
+  return true;
 }
 
-inline void logBlockedCommand(const NetworkPollResult& result, uint32_t now) {
-  (void)result;
-  (void)now;
+String configToJson(const RuntimeConfig& cfg) {
+  char priceBuf[16];
+  snprintf(priceBuf, sizeof(priceBuf), "%.2f", cfg.price);
+  return "{\"host_ip\":\"" + String(cfg.hostIp) +
+         "\",\"device_id\":\"" + String(cfg.deviceId) +
+         "\",\"device_id_2\":\"" + String(cfg.deviceId2) +
+         "\",\"price\":\"" + String(priceBuf) +
+         "\",\"inv_duration\":" + String(cfg.invoiceDurationSec) +
+         ",\"description\":\"" + String(cfg.description) +
+         "\",\"backends\":\"" + String(cfg.backends) + "\"}";
+}
+
+// Error messages echo keys and values the client sent, so unlike the
+// validated config fields they are escaped before going into JSON.
+inline String jsonQuoted(const String& value) {
+  String out = "\"";
+  out.reserve(value.length() + 2);
+  for (unsigned int i = 0; i < value.length(); i++) {
+    char c = value[i];
+    if (c == '"' || c == '\\') {
+      out += '\\';
+      out += c;
+    } else if ((unsigned char)c < 0x20) {
+      char escaped[8];
+      snprintf(escaped, sizeof(escaped), "\\u%04x", (unsigned)(unsigned char)c);
+      out += escaped;
+    } else {
+      out += c;
+    }
+  }
+  out += '"';
+  return out;
+}
+
+inline void sendConfigError(int code, const String& errorMsg) {
+  configServer.send(code, "application/json", "{\"error\":" + jsonQuoted(errorMsg) + "}");
+}
+
+void handleConfigGet() {
+  configServer.send(200, "application/json", configToJson(activeConfig()));
+}
+
+void handleBackendsGet() {
+  configServer.send(200, "application/json", backendHealthJson(millis()));
+}
+
+// POST /config with a JSON object of the keys to change, all or nothing.
+void handleConfigPost() {
+  if (configServer.header("X-Config-Token") != CONFIG_API_TOKEN) {
+    configServer.send(401, "application/json", "{\"error\":\"unauthorized\"}");
+    return;
+  }
+
+  DynamicJsonDocument doc(512);
+  DeserializationError err = deserializeJson(doc, configServer.arg("plain"));
+  if (err || !doc.is<JsonObject>()) {
+    configServer.send(400, "application/json", "{\"error\":\"invalid JSON\"}");
+    return;
+  }
+
+  RuntimeConfig next = activeConfig();
+  String errorMsg;
+  for (JsonPair kv : doc.as<JsonObject>()) {
+    // Numbers arrive unquoted; validate their JSON text like any other value.
+    char numberBuf[24];
+    const char* value = kv.value().as<const char*>();
+    if (!kv.value().is<const char*>()) {
+      serializeJson(kv.value(), numberBuf, sizeof(numberBuf));
+      value = numberBuf;
+    }
+    if (!setConfigField(&next, kv.key().c_str(), value, errorMsg)) {
+      sendConfigError(422, errorMsg);
+      return;
+    }
+  }
+  if (!commitConfig(next, errorMsg)) {
+    sendConfigError(422, errorMsg);
+    return;
+  }
+  configServer.send(200, "application/json", configToJson(activeConfig()));
+}
+
+// Without a token anyone on the network could re-point host_ip, so the
+// server is never started.
+inline void processConfigServer() {
+  if (CONFIG_API_TOKEN[0] == '\0' || WiFi.status() != WL_CONNECTED) return;
+  if (!configServerStarted) {
+    static const char* headerKeys[] = { "X-Config-Token" };
+    configServer.on("/config", HTTP_GET, handleConfigGet);
+    configServer.on("/config", HTTP_POST, handleConfigPost);
+    configServer.on("/backends", HTTP_GET, handleBackendsGet);
+    configServer.collectHeaders(headerKeys, 1);
+    configServer.begin();
+    configServerStarted = true;
+  }
+  configServer.handleClient();
+}
+
+// UART commands, one per line:
+//   get                  print the active config
+//   set <key> <value>    stage a change
+//   apply                validate and apply all staged changes at once
+//   discard              drop staged changes
+//   backends             print host pool health
+//   dedupe-reset [0|1]   forget accepted command_ids (both devices if omitted)
+void handleUartCommand(char* line) {
+  char* cmd = strtok(line, " ");
+  if (!cmd) return;
+  String errorMsg;
+
+  if (strcmp(cmd, "get") == 0) {
+    Serial.println("CFG " + configToJson(activeConfig()));
+    return;
+  }
+
+  if (strcmp(cmd, "set") == 0) {
+    char* key = strtok(nullptr, " ");
+    char* value = strtok(nullptr, "");
+    if (!uartStagedDirty) {
+      uartStagedConfig = activeConfig();
+    }
+    RuntimeConfig staged = uartStagedConfig;
+    if (!setConfigField(&staged, key, value, errorMsg)) {
+      Serial.println("CFG ERR " + errorMsg);
+      return;
+    }
+    uartStagedConfig = staged;
+    uartStagedDirty = true;
+    Serial.println("CFG STAGED");
+    return;
+  }
+
+  if (strcmp(cmd, "apply") == 0) {
+    if (!uartStagedDirty) {
+      Serial.println("CFG ERR nothing staged");
+      return;
+    }
+    if (!commitConfig(uartStagedConfig, errorMsg)) {
+      Serial.println("CFG ERR " + errorMsg);
+      return;
+    }
+    uartStagedDirty = false;
+    Serial.println("CFG OK " + configToJson(activeConfig()));
+    return;
+  }
+
+  if (strcmp(cmd, "backends") == 0) {
+    printBackendHealth(millis());
+    return;
+  }
+
+  if (strcmp(cmd, "discard") == 0) {
+    uartStagedDirty = false;
+    Serial.println("CFG OK");
+    return;
+  }
+
+  if (strcmp(cmd, "dedupe-reset") == 0) {
+    char* device = strtok(nullptr, " ");
+    if (device && strcmp(device, "0") != 0 && strcmp(device, "1") != 0) {
+      Serial.println("CFG ERR device must be 0 or 1");
+      return;
+    }
+    for (uint8_t i = 0; i < 2; i++) {
+      if (!device || device[0] - '0' == i) resetCommandDedupe(i);
+    }
+    Serial.println("CFG OK");
+    return;
+  }
+
+  Serial.println("CFG ERR unknown command");
+}
+
+inline void processUartCommands() {
+  while (Serial.available() > 0) {
+    char c = (char)Serial.read();
+    if (c == '\r') continue;
+    if (c == '\n') {
+      uartLine[uartLineLen] = '\0';
+      if (uartLineLen > 0) {
+        handleUartCommand(uartLine);
+      }
+      uartLineLen = 0;
+      continue;
+    }
+    if (uartLineLen < UART_COMMAND_MAX_LEN - 1) {
+      uartLine[uartLineLen++] = c;
+    }
+  }
 }
 
-inline bool enqueueInvoiceRequest(uint8_t deviceIndex) {
+inline bool enqueueInvoiceRequest(const InvoiceRequest& req) {
   const uint8_t capacity = (uint8_t)(sizeof(pendingInvoices) / sizeof(pendingInvoices[0]));
-  if (deviceIndex > 1 || pendingInvoiceCount >= capacity) return false;
-  pendingInvoices[pendingInvoiceTail].deviceIndex = deviceIndex;
+  if (req.deviceIndex > 1 || pendingInvoiceCount >= capacity) return false;
+  pendingInvoices[pendingInvoiceTail] = req;
   pendingInvoiceTail = (uint8_t)((pendingInvoiceTail + 1) % capacity);
   pendingInvoiceCount++;
   return true;
 }
 
+// An invoice that has never been attempted holds back the device's next
+// command, otherwise a back-to-back start would keep the channel busy and
+// starve the invoice. Retries no longer block the FIFO.
+inline bool hasFreshInvoiceRequestForDevice(uint8_t deviceIndex) {
+  const uint8_t capacity = (uint8_t)(sizeof(pendingInvoices) / sizeof(pendingInvoices[0]));
+  for (uint8_t i = 0; i < pendingInvoiceCount; i++) {
+    const InvoiceRequest& req = pendingInvoices[(pendingInvoiceHead + i) % capacity];
+    if (req.deviceIndex == deviceIndex && req.attempts == 0) return true;
+  }
+  for (uint8_t i = 0; invoiceJobBusy && i < invoiceJobInFlight.count; i++) {
+    const InvoiceRequest& req = invoiceJobInFlight.items[i];
+    if (req.deviceIndex == deviceIndex && req.attempts == 0) return true;
+  }
+  return false;
+}
+
 inline bool peekInvoiceRequest(InvoiceRequest* out) {
   if (!out || pendingInvoiceCount == 0) return false;
   *out = pendingInvoices[pendingInvoiceHead];
@@ -520,7 +1331,7 @@ inline bool dequeueInvoiceRequestAt(uint8_t offset, InvoiceRequest* out) {
   return removed;
 }
 
-inline void finishRelayTask(uint8_t ch, bool successful) {
+inline void finishRelayTask(uint8_t ch, bool successful, uint32_t now) {
   if (ch >= RELAY_CHANNEL_COUNT) return;
   int8_t deviceIndex = relayDeviceIndex[ch];
   if (deviceIndex >= 0 && deviceIndex <= 1) {
@@ -528,47 +1339,482 @@ inline void finishRelayTask(uint8_t ch, bool successful) {
       activeTaskCount[deviceIndex]--;
     }
     if (successful) {
-      (void)enqueueInvoiceRequest((uint8_t)deviceIndex);
+      InvoiceRequest req;
+      req.deviceIndex = (uint8_t)deviceIndex;
+      req.attempts = 0;
+      req.trace = relayTrace[ch];
+      req.trace.finishedMs = now;
+      memcpy(req.deviceId, relayDeviceId[ch], sizeof(req.deviceId));
+      (void)enqueueInvoiceRequest(req);
     }
   }
   relayDeviceIndex[ch] = -1;
 }
 
-bool requestInvoice(
-  const char* serverIp,
-  const char* deviceId,
-  const char* amount,
-  uint32_t durationSec,
-  String& invoiceId,
-  String& payUrl,
-  String& errorMsg
-) {
+// ======================= Backend Transport =======================
+// One kept-alive connection per traffic type, all owned by the network task:
+// pollLink for polls, invoiceLink for invoice jobs handed over by loop().
+// probeLink carries the occasional probe to a non-preferred host and is closed
+// afterwards, so probing never drops pollLink's connection.
+struct BackendLink {
+  WiFiClient plain;
+  WiFiClientSecure secure;
   HTTPClient http;
+  BackendEndpoint endpoint;
+  bool tlsConfigured;
+  uint32_t connects;
+  uint32_t connectMs;
+  uint32_t requests;
+  uint32_t failures;
+};
 
-  String url = "http://" + String(serverIp) + ":8000/api/device/" +
-               String(deviceId) + "/request-invoice/";
-  String body = "{\"amount\":\"" + String(amount) +
-                "\",\"description\":\"ESP32 auto invoice\"" +
-                ",\"duration_sec\":" + String(durationSec) + "}";
-
-  Serial.print("API ");
-  Serial.println(url);
+static BackendLink pollLink;
+static BackendLink invoiceLink;
+static BackendLink probeLink;
+static uint32_t lastTransportReportMs = 0;
+static uint32_t transportReportedConnects = 0;
+static uint32_t transportReportedConnectMs = 0;
+static uint32_t transportReportedRequests = 0;
+static uint32_t transportReportedFailures = 0;
+
+// Shared by both tasks; only touched inside backendMux.
+static portMUX_TYPE backendMux = portMUX_INITIALIZER_UNLOCKED;
+static BackendHealth backendHealth[BACKEND_MAX_HOSTS];
+static uint8_t backendCount = 0;
+static int8_t backendPreferred = -1;
+static uint32_t backendLastProbeMs = 0;
+static volatile uint32_t backendSwitchCount = 0;
+static uint32_t backendSwitchReported = 0;
+
+inline WiFiClient& backendClient(BackendLink& link) {
+  if (BACKEND_TLS_ENABLED) return link.secure;
+  return link.plain;
+}
 
-  http.setTimeout(INVOICE_HTTP_TIMEOUT_MS);
-  http.setReuse(false);
+inline uint16_t backendPort() {
+  return BACKEND_TLS_ENABLED ? BACKEND_TLS_PORT : HOST_PORT;
+}
 
-  if (!http.begin(url)) {
-    errorMsg = "http.begin() failed";
-    return false;
-  }
+inline void backendUrl(char* out, size_t outSize, const BackendEndpoint& endpoint,
+                       const char* path) {
+  snprintf(out, outSize, "%s://%s:%u%s", BACKEND_TLS_ENABLED ? "https" : "http",
+           endpoint.host, (unsigned)endpoint.port, path);
+}
 
-  http.addHeader("Content-Type", "application/json");
+inline bool sameEndpoint(const BackendEndpoint& a, const BackendEndpoint& b) {
+  return a.port == b.port && strcmp(a.host, b.host) == 0;
+}
 
-  int httpCode = http.POST(body);
+// host_ip on backendPort() first, then each "ip[:port]" of cfg.backends.
+bool parseBackendList(const RuntimeConfig& cfg, BackendEndpoint* out,
+                      uint8_t* count, String& errorMsg) {
+  strncpy(out[0].host, cfg.hostIp, sizeof(out[0].host));
+  out[0].host[sizeof(out[0].host) - 1] = '\0';
+  out[0].port = backendPort();
+  uint8_t n = 1;
+
+  char list[sizeof(cfg.backends)];
+  memcpy(list, cfg.backends, sizeof(list));
+  list[sizeof(list) - 1] = '\0';
+  char* save = nullptr;
+  for (char* item = strtok_r(list, ", ", &save); item; item = strtok_r(nullptr, ", ", &save)) {
+    if (n >= BACKEND_MAX_HOSTS) {
+      errorMsg = "at most " + String((unsigned)(BACKEND_MAX_HOSTS - 1)) + " backup hosts";
+      return false;
+    }
+    BackendEndpoint& endpoint = out[n];
+    endpoint.port = backendPort();
+    char* colon = strchr(item, ':');
+    if (colon) {
+      *colon = '\0';
+      char* end = nullptr;
+      long port = strtol(colon + 1, &end, 10);
+      if (end == colon + 1 || *end != '\0' || port < 1 || port > 65535) {
+        errorMsg = "bad port in " + String(item);
+        return false;
+      }
+      endpoint.port = (uint16_t)port;
+    }
+    IPAddress ip;
+    if (strlen(item) >= sizeof(endpoint.host) || !ip.fromString(item)) {
+      errorMsg = "not an IPv4 address: " + String(item);
+      return false;
+    }
+    memcpy(endpoint.host, item, strlen(item) + 1);
+    for (uint8_t i = 0; i < n; i++) {
+      if (sameEndpoint(out[i], endpoint)) {
+        errorMsg = "duplicate host " + String(item);
+        return false;
+      }
+    }
+    n++;
+  }
+  *count = n;
+  return true;
+}
 
-  // Always read the response body before closing the connection.
-  String response = http.getString();
-  http.end();
+// Rebuilds the host pool after boot or a host change; health starts fresh.
+void loadBackendEndpoints(const RuntimeConfig& cfg) {
+  BackendEndpoint endpoints[BACKEND_MAX_HOSTS];
+  uint8_t count = 0;
+  String errorMsg;
+  if (!parseBackendList(cfg, endpoints, &count, errorMsg)) {
+    count = 1;  // a bad stored list still leaves host_ip usable
+  }
+  portENTER_CRITICAL(&backendMux);
+  memset(backendHealth, 0, sizeof(backendHealth));
+  for (uint8_t i = 0; i < count; i++) {
+    backendHealth[i].endpoint = endpoints[i];
+  }
+  backendCount = count;
+  backendPreferred = 0;
+  backendSwitchCount++;
+  portEXIT_CRITICAL(&backendMux);
+}
+
+inline bool backendAvailable(const BackendHealth& h, uint32_t now) {
+  return h.consecutiveFailures < BACKEND_FAILS_TO_DOWN || timeReached(now, h.downUntilMs);
+}
+
+// Unmeasured hosts sort first so they get a sample.
+inline bool backendFaster(const BackendHealth& a, const BackendHealth& b) {
+  return a.rttEwmaMs < b.rttEwmaMs;
+}
+
+// Picks the host for the next request, skipping `exclude` (the host that just
+// failed). The preferred host is kept unless another healthy host beats its
+// EWMA by BACKEND_SWITCH_MARGIN_PCT, so similar hosts do not flap. Only
+// measured hosts compete on EWMA; a host with no RTT yet is never made
+// preferred on speed, it is sampled by the next `probe` request instead. With
+// `probe`, a healthy non-preferred host also gets one request every
+// BACKEND_PROBE_INTERVAL_MS to keep its estimate current (*probed).
+inline int8_t selectBackend(uint32_t now, int8_t exclude, bool probe,
+                            BackendEndpoint* endpoint, bool* probed) {
+  int8_t chosen = -1;
+  *probed = false;
+  portENTER_CRITICAL(&backendMux);
+  int8_t best = -1;
+  int8_t fallback = -1;
+  int8_t soonest = -1;
+  int8_t stalest = -1;
+  int8_t unmeasured = -1;
+  for (int8_t i = 0; i < (int8_t)backendCount; i++) {
+    if (i == exclude) continue;
+    const BackendHealth& h = backendHealth[i];
+    if (!backendAvailable(h, now)) {
+      if (soonest < 0 || (int32_t)(h.downUntilMs - backendHealth[soonest].downUntilMs) < 0) {
+        soonest = i;
+      }
+      continue;
+    }
+    if (fallback < 0 || i == backendPreferred) fallback = i;
+    if (h.rttEwmaMs == 0) {
+      if (i != backendPreferred && unmeasured < 0) unmeasured = i;
+      continue;
+    }
+    if (best < 0 || backendFaster(h, backendHealth[best])) best = i;
+    if (i != backendPreferred &&
+        (stalest < 0 || (int32_t)(h.lastUsedMs - backendHealth[stalest].lastUsedMs) < 0)) {
+      stalest = i;
+    }
+  }
+  // Nothing measured yet: stay on the preferred host, or the first healthy one.
+  if (best < 0) best = fallback;
+
+  if (best < 0) {
+    // Everything is benched: try the host that comes back first.
+    chosen = soonest;
+  } else if (exclude >= 0) {
+    chosen = best;
+  } else {
+    int8_t preferred = backendPreferred;
+    if (preferred >= 0 && preferred < (int8_t)backendCount &&
+        backendAvailable(backendHealth[preferred], now) && best != preferred &&
+        (uint64_t)backendHealth[best].rttEwmaMs * (100 + BACKEND_SWITCH_MARGIN_PCT) >=
+          (uint64_t)backendHealth[preferred].rttEwmaMs * 100) {
+      best = preferred;
+    }
+    if (best != backendPreferred) {
+      backendPreferred = best;
+      backendSwitchCount++;
+    }
+    chosen = best;
+    if (probe && unmeasured >= 0 && unmeasured != best) {
+      // Skips the interval, but stays bounded: a success gives the host an
+      // RTT and failures bench it.
+      backendLastProbeMs = now;
+      chosen = unmeasured;
+      *probed = true;
+    } else if (probe && stalest >= 0 && stalest != best &&
+               timeReached(now, backendLastProbeMs + BACKEND_PROBE_INTERVAL_MS)) {
+      backendLastProbeMs = now;
+      chosen = stalest;
+      *probed = true;
+    }
+  }
+
+  if (chosen >= 0) {
+    backendHealth[chosen].lastUsedMs = now;
+    *endpoint = backendHealth[chosen].endpoint;
+  }
+  portEXIT_CRITICAL(&backendMux);
+  return chosen;
+}
+
+// RTT EWMA uses alpha = 1/8, as TCP does for SRTT.
+inline void recordBackendResult(int8_t index, const BackendEndpoint& endpoint, bool ok,
+                                uint32_t rttMs, uint32_t now) {
+  portENTER_CRITICAL(&backendMux);
+  // The pool may have been rebuilt while the request was in flight.
+  if (index >= 0 && index < (int8_t)backendCount &&
+      sameEndpoint(backendHealth[index].endpoint, endpoint)) {
+    BackendHealth& h = backendHealth[index];
+    if (ok) {
+      if (rttMs == 0) rttMs = 1;
+      h.rttEwmaMs = (h.rttEwmaMs == 0) ? rttMs : (h.rttEwmaMs * 7 + rttMs) / 8;
+      h.consecutiveFailures = 0;
+      h.successes++;
+    } else {
+      h.failures++;
+      if (h.consecutiveFailures < 255) h.consecutiveFailures++;
+      if (h.consecutiveFailures >= BACKEND_FAILS_TO_DOWN) {
+        uint8_t extra = h.consecutiveFailures - BACKEND_FAILS_TO_DOWN;
+        uint32_t cooldown = BACKEND_COOLDOWN_MIN_MS << (extra < 5 ? extra : 5);
+        h.downUntilMs = now + (cooldown < BACKEND_COOLDOWN_MAX_MS ? cooldown
+                                                                   : BACKEND_COOLDOWN_MAX_MS);
+      }
+    }
+  }
+  portEXIT_CRITICAL(&backendMux);
+}
+
+// Keeps the link connected to the endpoint. A new connection (TCP connect
+// plus the TLS handshake and pin check when enabled) is counted and timed.
+inline bool backendConnect(BackendLink& link, const BackendEndpoint& endpoint) {
+  WiFiClient& client = backendClient(link);
+  if (!sameEndpoint(link.endpoint, endpoint)) {
+    client.stop();
+    link.endpoint = endpoint;
+  }
+  if (client.connected()) return true;
+
+  if (BACKEND_TLS_ENABLED && !link.tlsConfigured) {
+    if (BACKEND_TLS_FINGERPRINT[0] != '\0') {
+      link.secure.setInsecure();
+    } else if (BACKEND_TLS_CA_CERT[0] != '\0') {
+      link.secure.setCACert(BACKEND_TLS_CA_CERT);
+    }
+    link.secure.setHandshakeTimeout(BACKEND_CONNECT_TIMEOUT_MS / 1000);
+    link.tlsConfigured = true;
+  }
+
+  uint32_t startedMs = millis();
+  bool ok = client.connect(endpoint.host, endpoint.port, BACKEND_CONNECT_TIMEOUT_MS) == 1;
+  if (ok && BACKEND_TLS_ENABLED && BACKEND_TLS_FINGERPRINT[0] != '\0' &&
+      !link.secure.verify(BACKEND_TLS_FINGERPRINT, nullptr)) {
+    client.stop();
+    ok = false;
+  }
+  link.connects++;
+  link.connectMs += millis() - startedMs;
+  return ok;
+}
+
+// True when the request failed before any of it reached the server: the
+// connect failed or the socket was already dead when the headers went out.
+// Anything later (lost connection, read timeout) may have been handled.
+inline bool backendNothingSent(int code) {
+  return code == HTTPC_ERROR_CONNECTION_REFUSED ||
+         code == HTTPC_ERROR_SEND_HEADER_FAILED ||
+         code == HTTPC_ERROR_NOT_CONNECTED;
+}
+
+// GET when body is null, JSON POST otherwise. A request that fails on a
+// reused connection is retried once on a fresh one, since the backend may
+// have closed the idle socket in the meantime. POSTs are only retried when
+// nothing was sent, so a slow invoice is never created twice.
+inline int backendRequest(BackendLink& link, const BackendEndpoint& endpoint,
+                          const char* path, const String* body, uint16_t timeoutMs,
+                          String& response) {
+  char url[160];
+  backendUrl(url, sizeof(url), endpoint, path);
+  int code = HTTPC_ERROR_CONNECTION_REFUSED;
+  for (uint8_t attempt = 0; attempt < 2; attempt++) {
+    bool reused = sameEndpoint(link.endpoint, endpoint) && backendClient(link).connected();
+    if (!backendConnect(link, endpoint)) break;
+
+    link.http.setReuse(true);
+    link.http.setTimeout(timeoutMs);
+    if (!link.http.begin(backendClient(link), url)) break;
+    if (body) {
+      link.http.addHeader("Content-Type", "application/json");
+      code = link.http.POST(*body);
+    } else {
+      code = link.http.GET();
+    }
+
+    if (code > 0) {
+      // Always read the response body so the connection can be reused.
+      response = link.http.getString();
+      link.http.end();
+      break;
+    }
+    link.http.end();
+    backendClient(link).stop();
+    if (!reused || (body && !backendNothingSent(code))) break;
+  }
+  link.requests++;
+  if (code <= 0) link.failures++;
+  return code;
+}
+
+// Sends the request to the selected host and, if that host fails (no
+// response or 5xx), once more to the next best host. A POST only moves on
+// when nothing reached the first host; otherwise the invoice queue retries it
+// later, so the same invoice is not created on two backends.
+inline int backendCall(BackendLink& link, const char* path, const String* body,
+                       uint16_t timeoutMs, String& response, bool probe) {
+  int code = HTTPC_ERROR_CONNECTION_REFUSED;
+  int8_t failed = -1;
+  for (uint8_t attempt = 0; attempt < 2; attempt++) {
+    BackendEndpoint endpoint;
+    bool probed = false;
+    int8_t index = selectBackend(millis(), failed, probe && attempt == 0, &endpoint, &probed);
+    if (index < 0) break;
+    BackendLink& used = probed ? probeLink : link;
+    uint32_t startedMs = millis();
+    uint32_t connectMsBefore = used.connectMs;
+    code = backendRequest(used, endpoint, path, body, timeoutMs, response);
+    if (probed) {
+      backendClient(used).stop();
+    }
+    // Handshakes are reported on the H line; keep them out of the RTT so a
+    // reconnect does not push traffic to another host.
+    uint32_t rttMs = (millis() - startedMs) - (used.connectMs - connectMsBefore);
+    bool ok = code > 0 && code < 500;
+    recordBackendResult(index, endpoint, ok, rttMs, millis());
+    if (ok || (body && !backendNothingSent(code))) break;
+    failed = index;
+  }
+  return code;
+}
+
+// "B <index> <host>:<port> r<ewma_ms>" whenever the preferred host changes.
+inline void reportBackendSelection() {
+  uint32_t count = backendSwitchCount;
+  if (count == backendSwitchReported) return;
+  backendSwitchReported = count;
+  portENTER_CRITICAL(&backendMux);
+  int8_t index = backendPreferred;
+  BackendHealth h = backendHealth[index >= 0 ? index : 0];
+  portEXIT_CRITICAL(&backendMux);
+  Serial.print("B ");
+  Serial.print((int)index);
+  Serial.print(" ");
+  Serial.print(h.endpoint.host);
+  Serial.print(":");
+  Serial.print(h.endpoint.port);
+  Serial.print(" r");
+  Serial.println(h.rttEwmaMs);
+}
+
+// GET /backends: the host pool in selection order with its health.
+String backendHealthJson(uint32_t now) {
+  String json = "{\"preferred\":" + String((int)backendPreferred) + ",\"hosts\":[";
+  for (uint8_t i = 0; i < BACKEND_MAX_HOSTS; i++) {
+    portENTER_CRITICAL(&backendMux);
+    bool valid = i < backendCount;
+    BackendHealth h = backendHealth[i];
+    portEXIT_CRITICAL(&backendMux);
+    if (!valid) break;
+    uint32_t downMs = backendAvailable(h, now) ? 0 : h.downUntilMs - now;
+    if (i > 0) json += ",";
+    json += "{\"host\":\"" + String(h.endpoint.host) +
+            "\",\"port\":" + String((unsigned)h.endpoint.port) +
+            ",\"rtt_ewma_ms\":" + String((unsigned long)h.rttEwmaMs) +
+            ",\"consecutive_failures\":" + String((unsigned)h.consecutiveFailures) +
+            ",\"down_ms\":" + String((unsigned long)downMs) +
+            ",\"successes\":" + String((unsigned long)h.successes) +
+            ",\"failures\":" + String((unsigned long)h.failures) + "}";
+  }
+  return json + "]}";
+}
+
+// "B <index> <host>:<port>[*] r<ewma_ms> f<fails> d<down_ms> ok<n> e<n>" per
+// host for the UART `backends` command; `*` marks the preferred host.
+inline void printBackendHealth(uint32_t now) {
+  for (uint8_t i = 0; i < BACKEND_MAX_HOSTS; i++) {
+    portENTER_CRITICAL(&backendMux);
+    bool valid = i < backendCount;
+    bool preferred = (int8_t)i == backendPreferred;
+    BackendHealth h = backendHealth[i];
+    portEXIT_CRITICAL(&backendMux);
+    if (!valid) break;
+    uint32_t downMs = backendAvailable(h, now) ? 0 : h.downUntilMs - now;
+    Serial.print("B ");
+    Serial.print(i);
+    Serial.print(" ");
+    Serial.print(h.endpoint.host);
+    Serial.print(":");
+    Serial.print(h.endpoint.port);
+    Serial.print(preferred ? "* r" : " r");
+    Serial.print(h.rttEwmaMs);
+    Serial.print(" f");
+    Serial.print(h.consecutiveFailures);
+    Serial.print(" d");
+    Serial.print(downMs);
+    Serial.print(" ok");
+    Serial.print(h.successes);
+    Serial.print(" e");
+    Serial.println(h.failures);
+  }
+}
+
+// Hourly "H <connects> m<connect_ms> q<requests> e<errors>" line covering both
+// links; with keep-alive, connects should stay far below requests.
+inline void reportTransportStats(uint32_t now) {
+  if (!timeReached(now, lastTransportReportMs + TRANSPORT_REPORT_INTERVAL_MS)) return;
+  lastTransportReportMs = now;
+  uint32_t connects = pollLink.connects + invoiceLink.connects + probeLink.connects;
+  uint32_t connectMs = pollLink.connectMs + invoiceLink.connectMs + probeLink.connectMs;
+  uint32_t requests = pollLink.requests + invoiceLink.requests + probeLink.requests;
+  uint32_t failures = pollLink.failures + invoiceLink.failures + probeLink.failures;
+  Serial.print("H ");
+  Serial.print(connects - transportReportedConnects);
+  Serial.print(" m");
+  Serial.print(connectMs - transportReportedConnectMs);
+  Serial.print(" q");
+  Serial.print(requests - transportReportedRequests);
+  Serial.print(" e");
+  Serial.println(failures - transportReportedFailures);
+  transportReportedConnects = connects;
+  transportReportedConnectMs = connectMs;
+  transportReportedRequests = requests;
+  transportReportedFailures = failures;
+}
+
+bool requestInvoice(
+  const char* deviceId,
+  const char* amount,
+  uint32_t durationSec,
+  const CommandTrace& trace,
+  String& invoiceId,
+  String& payUrl,
+  String& errorMsg
+) {
+  char path[64];
+  snprintf(path, sizeof(path), "/api/device/%s/request-invoice/", deviceId);
+  String body = "{\"amount\":\"" + String(amount) +
+                "\",\"description\":\"ESP32 auto invoice\"" +
+                ",\"duration_sec\":" + String(durationSec) +
+                traceJsonFields(trace) + "}";
+
+  Serial.print("API ");
+  Serial.println(path);
+
+  String response;
+  int httpCode = backendCall(invoiceLink, path, &body, INVOICE_HTTP_TIMEOUT_MS,
+                             response, false);
 
   if (httpCode != 201) {
     errorMsg = "HTTP " + String(httpCode) + " -> " + response;
@@ -594,82 +1840,212 @@ bool requestInvoice(
   return true;
 }
 
-inline void processInvoiceRequests(uint32_t now) {
-  if (pendingInvoiceCount == 0 || WiFi.status() != WL_CONNECTED) return;
-  if (!timeReached(now, lastInvoiceAttemptMs + 1000U)) return;
+// Batch contract: one POST carries every ready invoice and the backend answers
+// with a "results" array in the same order. 404/405 means the backend has no
+// batch endpoint (*unsupported), so the caller falls back to the per-device
+// endpoint.
+bool requestInvoiceBatch(
+  const InvoiceRequest* reqs,
+  uint8_t count,
+  const char* amount,
+  uint32_t durationSec,
+  bool* itemOk,
+  bool* unsupported,
+  String& errorMsg
+) {
+  if (!reqs || !itemOk || !unsupported || count == 0) {
+    errorMsg = "empty batch";
+    return false;
+  }
+  for (uint8_t i = 0; i < count; i++) {
+    itemOk[i] = false;
+  }
+  *unsupported = false;
+
+  const char* path = "/api/device/request-invoice/batch/";
+  String body = "{\"items\":[";
+  for (uint8_t i = 0; i < count; i++) {
+    if (i > 0) body += ",";
+    body += "{\"device_id\":\"" + String(reqs[i].deviceId) +
+            "\",\"amount\":\"" + String(amount) +
+            "\",\"description\":\"ESP32 auto invoice\"" +
+            ",\"duration_sec\":" + String(durationSec) +
+            traceJsonFields(reqs[i].trace) + "}";
+  }
+  body += "]}";
 
-  uint8_t readyOffset = pendingInvoiceCount;
-  for (uint8_t i = 0; i < pendingInvoiceCount; i++) {
-    uint8_t idx = (uint8_t)((pendingInvoiceHead + i) %
-                            (sizeof(pendingInvoices) / sizeof(pendingInvoices[0])));
+  Serial.print("API ");
+  Serial.println(path);
+
+  String response;
+  int httpCode = backendCall(invoiceLink, path, &body, INVOICE_HTTP_TIMEOUT_MS,
+                             response, false);
+
+  if (httpCode == 404 || httpCode == 405) {
+    *unsupported = true;
+  }
+
+  if (httpCode != 200 && httpCode != 201) {
+    errorMsg = "HTTP " + String(httpCode) + " -> " + response;
+    return false;
+  }
+
+  DynamicJsonDocument doc(512 + 384 * (size_t)count);
+  DeserializationError err = deserializeJson(doc, response);
+  if (err) {
+    errorMsg = "JSON parse failed: " + String(err.c_str());
+    return false;
+  }
+
+  JsonArray results = doc["results"];
+  if (results.isNull()) {
+    errorMsg = "Missing results in response";
+    return false;
+  }
+
+  bool allOk = true;
+  for (uint8_t i = 0; i < count; i++) {
+    JsonObject item = results[i];
+    const char* deviceId = reqs[i].deviceId;
+    const char* itemDevice = item["device_id"] | deviceId;
+    String invoiceId = item["public_id"] | "";
+    String payUrl = item["pay_url"] | "";
+    itemOk[i] = strcmp(itemDevice, deviceId) == 0 &&
+                !invoiceId.isEmpty() && !payUrl.isEmpty();
+    allOk = allOk && itemOk[i];
+  }
+
+  errorMsg = allOk ? "" : "Missing public_id or pay_url in batch response";
+  return allOk;
+}
+
+inline uint8_t takeReadyInvoiceRequests(uint32_t now, InvoiceRequest* out,
+                                        uint8_t maxCount) {
+  const uint8_t capacity = (uint8_t)(sizeof(pendingInvoices) / sizeof(pendingInvoices[0]));
+  uint8_t taken = 0;
+  uint8_t offset = 0;
+  while (taken < maxCount && offset < pendingInvoiceCount) {
+    uint8_t idx = (uint8_t)((pendingInvoiceHead + offset) % capacity);
     const InvoiceRequest& candidate = pendingInvoices[idx];
     int8_t mappedRelay = relayChannelForDevice(candidate.deviceIndex);
-    if (mappedRelay >= 0 && channelAvailable((uint8_t)mappedRelay, now)) {
-      readyOffset = i;
-      break;
+    if (mappedRelay >= 0 && channelAvailable((uint8_t)mappedRelay, now) &&
+        dequeueInvoiceRequestAt(offset, &out[taken])) {
+      // Removing the entry shifts the rest down, so the offset stays put.
+      taken++;
+      continue;
     }
+    offset++;
   }
+  return taken;
+}
 
-  if (readyOffset >= pendingInvoiceCount) return;
+// Network task side of an invoice job.
+inline void runInvoiceJob(const InvoiceJob& job, InvoiceJobResult* result) {
+  memset(result, 0, sizeof(*result));
+  String errorMsg;
 
-  InvoiceRequest req;
-  if (!dequeueInvoiceRequestAt(readyOffset, &req)) return;
-  lastInvoiceAttemptMs = now;
+  if (job.count > 1) {
+    (void)requestInvoiceBatch(job.items, job.count, job.amount, job.durationSec,
+                              result->itemOk, &result->batchUnsupported, errorMsg);
+  } else if (job.count == 1) {
+    String invoiceId;
+    String payUrl;
+    result->itemOk[0] = requestInvoice(job.items[0].deviceId, job.amount, job.durationSec,
+                                       job.items[0].trace, invoiceId, payUrl, errorMsg);
+  }
+  result->ackMs = millis();
+}
 
-  const char* deviceId = (req.deviceIndex == 0) ? DEVICE_ID : DEVICE_ID2;
-  if (req.deviceIndex == 1 && !DEVICE2_ENABLED) return;
+// Failed entries go back on the queue for the next slot.
+inline void collectInvoiceJobResult() {
+  if (!invoiceJobBusy || invoiceResultQueue == nullptr) return;
+  InvoiceJobResult result;
+  if (xQueueReceive(invoiceResultQueue, &result, 0) != pdTRUE) return;
+  invoiceJobBusy = false;
 
-  char amountBuf[16];
-  snprintf(amountBuf, sizeof(amountBuf), "%.2f", PRICE);
-  String invoiceId;
-  String payUrl;
-  String errorMsg;
-  if (!requestInvoice(HOST_IP, deviceId, amountBuf,
-                      (uint32_t)INVOICE_DURATION,
-                      invoiceId, payUrl, errorMsg)) {
-    (void)enqueueInvoiceRequest(req.deviceIndex);
+  if (result.batchUnsupported) {
+    invoiceBatchSupported = false;
+    invoiceBatchRetryAtMs = result.ackMs + INVOICE_BATCH_RETRY_MS;
+  }
+  for (uint8_t i = 0; i < invoiceJobInFlight.count; i++) {
+    InvoiceRequest& req = invoiceJobInFlight.items[i];
+    if (result.itemOk[i]) {
+      reportCommandLatency(req.deviceId, req.trace, result.ackMs);
+      continue;
+    }
+    req.attempts++;
+    (void)enqueueInvoiceRequest(req);
   }
 }
 
+inline void processInvoiceRequests(uint32_t now) {
+  collectInvoiceJobResult();
+  if (invoiceJobBusy || invoiceJobQueue == nullptr) return;
+  if (pendingInvoiceCount == 0 || WiFi.status() != WL_CONNECTED) return;
+  if (!timeReached(now, lastInvoiceAttemptMs + 1000U)) return;
+
+  if (!invoiceBatchSupported && INVOICE_BATCH_ENABLED &&
+      timeReached(now, invoiceBatchRetryAtMs)) {
+    invoiceBatchSupported = true;
+  }
+
+  InvoiceJob& job = invoiceJobInFlight;
+  const uint8_t maxReady = invoiceBatchSupported
+                             ? (uint8_t)(sizeof(job.items) / sizeof(job.items[0]))
+                             : 1;
+  job.count = takeReadyInvoiceRequests(now, job.items, maxReady);
+  if (job.count == 0) return;
+  lastInvoiceAttemptMs = now;
+  if (job.count == 1 && job.items[0].deviceIndex == 1 && !DEVICE2_ENABLED) return;
+
+  const RuntimeConfig& cfg = activeConfig();
+  snprintf(job.amount, sizeof(job.amount), "%.2f", cfg.price);
+  job.durationSec = (uint32_t)cfg.invoiceDurationSec;
+  if (xQueueSend(invoiceJobQueue, &job, 0) != pdTRUE) {
+    for (uint8_t i = 0; i < job.count; i++) {
+      (void)enqueueInvoiceRequest(job.items[i]);
+    }
+    return;
+  }
+  invoiceJobBusy = true;
+}
+
 inline void processPendingCommands(uint32_t now) {
   if (pendingCommandCount == 0) return;
 
-  PendingCommand kept[RELAY_CHANNEL_COUNT];
-  uint8_t keptCount = 0;
-  while (pendingCommandCount > 0) {
-    PendingCommand cmd;
-    if (!dequeuePendingCommand(&cmd)) {
-      break;
-    }
+  for (uint8_t deviceIndex = 0; deviceIndex < 2; deviceIndex++) {
+    if (pendingCommandDeviceCount[deviceIndex] == 0) continue;
 
-    int8_t ch = relayChannelForDevice(cmd.deviceIndex);
-    if (ch >= 0 && channelAvailable((uint8_t)ch, now)) {
-      strncpy(ACTIVE_DEVICE_ID, cmd.deviceId, sizeof(ACTIVE_DEVICE_ID));
-      ACTIVE_DEVICE_ID[sizeof(ACTIVE_DEVICE_ID) - 1] = '\0';
-      startRelayPulse((uint8_t)ch, cmd.durationMs, now, cmd.deviceIndex);
+    int8_t ch = relayChannelForDevice(deviceIndex);
+    if (ch < 0 || !channelAvailable((uint8_t)ch, now)) continue;
+    if (WiFi.status() == WL_CONNECTED &&
+        hasFreshInvoiceRequestForDevice(deviceIndex)) {
       continue;
     }
 
-    kept[keptCount++] = cmd;
-  }
-
-  pendingCommandHead = 0;
-  pendingCommandTail = 0;
-  pendingCommandCount = 0;
-  for (uint8_t i = 0; i < keptCount; i++) {
-    (void)enqueuePendingCommand(kept[i].deviceIndex, kept[i].durationMs,
-                                kept[i].deviceId);
+    PendingCommand cmd;
+    if (!dequeuePendingCommand(deviceIndex, &cmd)) continue;
+    strncpy(ACTIVE_DEVICE_ID, cmd.deviceId, sizeof(ACTIVE_DEVICE_ID));
+    ACTIVE_DEVICE_ID[sizeof(ACTIVE_DEVICE_ID) - 1] = '\0';
+    startRelayPulse((uint8_t)ch, cmd.durationMs, now, cmd.deviceIndex, cmd.deviceId,
+                    cmd.commandId, cmd.receivedMs);
+    recordCommandId(deviceIndex, cmd.commandId);
   }
 }
 
-
-
 inline void startRelayPulse(uint8_t ch, uint32_t onMs, uint32_t now,
-                            uint8_t deviceIndex) {
+                            uint8_t deviceIndex, const char* deviceId,
+                            int32_t commandId, uint32_t receivedMs) {
   if (ch >= RELAY_CHANNEL_COUNT) return;
   relayWrite(ch, true);
   relayState[ch] = true;
   relayDeviceIndex[ch] = (deviceIndex <= 1) ? (int8_t)deviceIndex : -1;
+  strncpy(relayDeviceId[ch], deviceId ? deviceId : "", sizeof(relayDeviceId[ch]));
+  relayDeviceId[ch][sizeof(relayDeviceId[ch]) - 1] = '\0';
+  relayTrace[ch].commandId = commandId;
+  relayTrace[ch].receivedMs = receivedMs;
+  relayTrace[ch].startedMs = now;
+  relayTrace[ch].finishedMs = 0;
   if (deviceIndex <= 1) {
     activeTaskCount[deviceIndex]++;
   }
@@ -679,6 +2055,8 @@ inline void startRelayPulse(uint8_t ch, uint32_t onMs, uint32_t now,
   relayCooldownUntilMs[ch] = now + onMs;
   relayWatchdogUntilMs[ch] = now + onMs + RELAY_WATCHDOG_GRACE_MS +
                              (2U * RELAY_PULSE_MS);
+  relayHoldUntilUs[ch] = systemTimeUs() + (int64_t)onMs * 1000;
+  checkpointRelay(ch);
 }
 
 inline void updateRelayPulses(uint32_t now) {
@@ -695,7 +2073,8 @@ inline void updateRelayPulses(uint32_t now) {
       pulseUntilMs[ch] = 0;
       pulseEdgeMs[ch] = 0;
       relayWatchdogUntilMs[ch] = 0;
-      finishRelayTask(ch, false);
+      finishRelayTask(ch, false, now);
+      checkpointRelay(ch, true);
       continue;
     }
 
@@ -703,6 +2082,7 @@ inline void updateRelayPulses(uint32_t now) {
         timeReached(now, pulseEdgeMs[ch])) {
       relayWrite(ch, false);
       relayPhase[ch] = RELAY_PHASE_ACTIVE_WAIT;
+      checkpointRelay(ch, true);
       continue;
     }
 
@@ -711,6 +2091,7 @@ inline void updateRelayPulses(uint32_t now) {
       relayWrite(ch, true);
       relayPhase[ch] = RELAY_PHASE_STOP_PULSE;
       pulseEdgeMs[ch] = now + RELAY_PULSE_MS;
+      checkpointRelay(ch);
       continue;
     }
 
@@ -722,10 +2103,452 @@ inline void updateRelayPulses(uint32_t now) {
       pulseUntilMs[ch] = 0;
       pulseEdgeMs[ch] = 0;
       relayWatchdogUntilMs[ch] = 0;
-      finishRelayTask(ch, true);
+      finishRelayTask(ch, true, now);
+      checkpointRelay(ch, true);
     }
   }
 }
+
+// ======================= Crash Recovery =======================
+// Each phase change of a relay task is checkpointed to RTC memory, which
+// survives panics, watchdog and brownout resets, and mirrored to Preferences
+// from the network task for power-on resets. The two edges that decide
+// billing after a power loss, latch on (start pulse -> active) and task
+// finished (-> idle), are written to Preferences synchronously instead.
+// Hold deadlines are stored as system time, which ESP-IDF keeps running
+// across every reset except power-on, so a valid RTC checkpoint can resume
+// the remaining hold.
+// Explicit reserved fields keep both structs free of padding, so the
+// checksum never covers bytes a struct copy may leave undefined.
+struct RelayCheckpoint {
+  int64_t holdUntilUs;
+  int32_t commandId;
+  uint8_t phase;
+  int8_t deviceIndex;
+  uint8_t reserved[2];
+};
+
+struct RelayCheckpointBlock {
+  uint32_t magic;
+  uint32_t reserved;
+  RelayCheckpoint channels[RELAY_CHANNEL_COUNT];
+  uint32_t checksum;
+};
+
+static const uint32_t RELAY_CHECKPOINT_MAGIC = 0x53504b31;
+// Clock changes smaller than this are jitter between the two time reads.
+static const int64_t RELAY_CHECKPOINT_STEP_US = 10000;
+static RTC_NOINIT_ATTR RelayCheckpointBlock rtcCheckpoint;
+static portMUX_TYPE checkpointMux = portMUX_INITIALIZER_UNLOCKED;
+static volatile bool checkpointPersistPending = false;
+// Held across snapshot and write, so a slower writer never lands an older
+// checkpoint after a newer one.
+static SemaphoreHandle_t checkpointWriteLock = nullptr;
+static int64_t systemClockBaseUs = 0;
+
+inline int64_t systemTimeUs() {
+  struct timeval tv;
+  gettimeofday(&tv, nullptr);
+  return (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+inline uint32_t checkpointChecksum(const RelayCheckpointBlock& block) {
+  // FNV-1a over everything before the checksum field.
+  const uint8_t* bytes = (const uint8_t*)&block;
+  uint32_t hash = 2166136261UL;
+  for (size_t i = 0; i < offsetof(RelayCheckpointBlock, checksum); i++) {
+    hash = (hash ^ bytes[i]) * 16777619UL;
+  }
+  return hash;
+}
+
+inline bool checkpointValid(const RelayCheckpointBlock& block) {
+  return block.magic == RELAY_CHECKPOINT_MAGIC &&
+         block.checksum == checkpointChecksum(block);
+}
+
+// Writes the current RTC checkpoint to Preferences from the calling task.
+// Uses its own Preferences handle because the loop task owns `prefs`.
+inline bool writeRelayCheckpoint() {
+  if (checkpointWriteLock != nullptr) {
+    xSemaphoreTake(checkpointWriteLock, portMAX_DELAY);
+  }
+  RelayCheckpointBlock block;
+  portENTER_CRITICAL(&checkpointMux);
+  block = rtcCheckpoint;
+  portEXIT_CRITICAL(&checkpointMux);
+  Preferences store;
+  bool ok = store.begin(NVS_NS, false);
+  if (ok) {
+    store.putBytes(NVS_KEY_RELAY_CHECKPOINT, &block, sizeof(block));
+    store.end();
+  }
+  if (checkpointWriteLock != nullptr) {
+    xSemaphoreGive(checkpointWriteLock);
+  }
+  return ok;
+}
+
+inline void checkpointRelay(uint8_t ch, bool toFlash) {
+  if (ch >= RELAY_CHANNEL_COUNT) return;
+  RelayCheckpoint cp;
+  memset(&cp, 0, sizeof(cp));
+  cp.phase = (uint8_t)relayPhase[ch];
+  cp.deviceIndex = relayState[ch] ? relayDeviceIndex[ch] : -1;
+  cp.commandId = relayTrace[ch].commandId;
+  cp.holdUntilUs = relayHoldUntilUs[ch];
+  portENTER_CRITICAL(&checkpointMux);
+  if (rtcCheckpoint.magic != RELAY_CHECKPOINT_MAGIC) {
+    memset(&rtcCheckpoint, 0, sizeof(rtcCheckpoint));
+    rtcCheckpoint.magic = RELAY_CHECKPOINT_MAGIC;
+  }
+  rtcCheckpoint.channels[ch] = cp;
+  rtcCheckpoint.checksum = checkpointChecksum(rtcCheckpoint);
+  portEXIT_CRITICAL(&checkpointMux);
+  // A synchronous write covers every earlier phase change too.
+  checkpointPersistPending = !toFlash || !writeRelayCheckpoint();
+}
+
+// Called from the network task, like persistConfigIfPending().
+void persistRelayCheckpointIfPending() {
+  if (!checkpointPersistPending) return;
+  checkpointPersistPending = false;
+  if (!writeRelayCheckpoint()) {
+    checkpointPersistPending = true;
+  }
+}
+
+// SNTP steps the system clock; shift in-flight hold deadlines with it so a
+// checkpoint written after the step still describes the same instant.
+inline void trackSystemTimeSteps() {
+  int64_t base = systemTimeUs() - esp_timer_get_time();
+  int64_t stepUs = base - systemClockBaseUs;
+  systemClockBaseUs = base;
+  if (stepUs > -RELAY_CHECKPOINT_STEP_US && stepUs < RELAY_CHECKPOINT_STEP_US) return;
+  for (uint8_t ch = 0; ch < RELAY_CHANNEL_COUNT; ch++) {
+    if (!relayState[ch]) continue;
+    relayHoldUntilUs[ch] += stepUs;
+    checkpointRelay(ch);
+  }
+}
+
+// Runs first thing in setup() with every relay output already released.
+// A hold that is still running is resumed when the RTC checkpoint is valid.
+// Anything else is closed: a stop pulse unless the stop pulse had already
+// started, then the invoice is queued as for a normal finish. A reset during
+// the start pulse is treated as latched on. After a power loss only the
+// flash copy is left and system time restarted, so its tasks are always
+// closed; the synchronous latch-on and finish writes keep it current at the
+// edges that decide the latch position and the bill. Returns true when a
+// task was resumed and loop() must start without delay.
+bool recoverRelayTasks() {
+  systemClockBaseUs = systemTimeUs() - esp_timer_get_time();
+
+  RelayCheckpointBlock block;
+  bool rtcValid = checkpointValid(rtcCheckpoint);
+  if (rtcValid) {
+    block = rtcCheckpoint;
+  } else {
+    bool flashValid = false;
+    if (prefs.begin(NVS_NS, true)) {
+      flashValid = prefs.getBytes(NVS_KEY_RELAY_CHECKPOINT, &block, sizeof(block)) ==
+                     sizeof(block) &&
+                   checkpointValid(block);
+      prefs.end();
+    }
+    if (!flashValid) {
+      memset(&block, 0, sizeof(block));
+    }
+  }
+
+  uint32_t now = millis();
+  int64_t nowUs = systemTimeUs();
+  bool resumed = false;
+  bool closing[RELAY_CHANNEL_COUNT] = { false, false };
+  bool needsStopPulse = false;
+
+  for (uint8_t ch = 0; ch < RELAY_CHANNEL_COUNT; ch++) {
+    const RelayCheckpoint& cp = block.channels[ch];
+    if (cp.phase == RELAY_PHASE_IDLE || cp.deviceIndex < 0 || cp.deviceIndex > 1) {
+      continue;
+    }
+    // The checkpoint has no room for the polled id; the configured one is the
+    // best guess after a reset.
+    relayDeviceIndex[ch] = cp.deviceIndex;
+    strncpy(relayDeviceId[ch], configDeviceId(activeConfig(), (uint8_t)cp.deviceIndex),
+            sizeof(relayDeviceId[ch]));
+    relayDeviceId[ch][sizeof(relayDeviceId[ch]) - 1] = '\0';
+    activeTaskCount[cp.deviceIndex]++;
+    relayTrace[ch].commandId = cp.commandId;
+    relayTrace[ch].receivedMs = now;
+    relayTrace[ch].startedMs = now;
+    relayTrace[ch].finishedMs = 0;
+
+    int64_t remainingUs = cp.holdUntilUs - nowUs;
+    if (rtcValid && cp.phase != RELAY_PHASE_STOP_PULSE &&
+        remainingUs > (int64_t)RELAY_PULSE_MS * 1000) {
+      uint32_t remainingMs = (uint32_t)(remainingUs / 1000);
+      relayState[ch] = true;
+      relayPhase[ch] = RELAY_PHASE_ACTIVE_WAIT;
+      pulseUntilMs[ch] = now + remainingMs;
+      relayCooldownUntilMs[ch] = now + remainingMs;
+      relayWatchdogUntilMs[ch] = now + remainingMs + RELAY_WATCHDOG_GRACE_MS +
+                                 (2U * RELAY_PULSE_MS);
+      relayHoldUntilUs[ch] = cp.holdUntilUs;
+      resumed = true;
+      Serial.print("K ");
+      Serial.print(ch);
+      Serial.print(" r");
+      Serial.println(remainingMs);
+      continue;
+    }
+
+    closing[ch] = true;
+    if (cp.phase != RELAY_PHASE_STOP_PULSE) {
+      relayWrite(ch, true);
+      needsStopPulse = true;
+    }
+  }
+
+  if (needsStopPulse) {
+    delay(RELAY_PULSE_MS);
+  }
+  for (uint8_t ch = 0; ch < RELAY_CHANNEL_COUNT; ch++) {
+    if (!closing[ch]) continue;
+    relayWrite(ch, false);
+    finishRelayTask(ch, true, millis());
+    Serial.print("K ");
+    Serial.print(ch);
+    Serial.println(" c");
+  }
+
+  // A recovered state is written before loop() starts, so a second power
+  // loss cannot close and bill the same task again.
+  bool recovered = resumed || closing[0] || closing[1];
+  for (uint8_t ch = 0; ch < RELAY_CHANNEL_COUNT; ch++) {
+    checkpointRelay(ch, recovered && ch + 1 == RELAY_CHANNEL_COUNT);
+  }
+  return resumed;
+}
+// ======================= Power Management =======================
+// Wall-clock time at each CPU clock level, switched by powerUpdateClock().
+// Whether the loop task is blocked is tracked separately, since the chip
+// keeps running the network task meanwhile and either clock can be active.
+enum PowerState : uint8_t {
+  POWER_STATE_ACTIVE = 0,
+  POWER_STATE_IDLE,
+  POWER_STATE_COUNT
+};
+
+static PowerState powerState = POWER_STATE_ACTIVE;
+static int64_t powerMarkUs = 0;
+static uint64_t powerStateUs[POWER_STATE_COUNT] = { 0, 0 };
+static uint64_t powerBlockedUs = 0;
+static bool powerHighClock = true;
+#if CONFIG_PM_ENABLE
+static esp_pm_lock_handle_t powerCpuLock = nullptr;
+#endif
+// Light sleep is only visible through the PM sleep callbacks (IDF 5.2+),
+// which also arm the opto wakeup around each sleep.
+#if CONFIG_PM_ENABLE && CONFIG_FREERTOS_USE_TICKLESS_IDLE && CONFIG_PM_LIGHT_SLEEP_CALLBACKS
+#define POWER_SLEEP_CALLBACKS 1
+static portMUX_TYPE powerSleepMux = portMUX_INITIALIZER_UNLOCKED;
+static uint64_t powerLightSleepUs = 0;
+#else
+#define POWER_SLEEP_CALLBACKS 0
+#endif
+
+inline void powerEnterState(PowerState next) {
+  int64_t nowUs = esp_timer_get_time();
+  powerStateUs[powerState] += (uint64_t)(nowUs - powerMarkUs);
+  powerMarkUs = nowUs;
+  powerState = next;
+}
+
+inline uint32_t powerStateSeconds(PowerState state) {
+  uint64_t us = powerStateUs[state];
+  if (state == powerState) {
+    us += (uint64_t)(esp_timer_get_time() - powerMarkUs);
+  }
+  return (uint32_t)(us / 1000000ULL);
+}
+
+inline uint32_t powerBlockedSeconds() {
+  return (uint32_t)(powerBlockedUs / 1000000ULL);
+}
+
+#if POWER_SLEEP_CALLBACKS
+// GPIO wakeup is level-only and shares the pin's interrupt type with the
+// CHANGE interrupt from attachInterrupt(), so it is armed just for the sleep:
+// each opto wakes on the level opposite to its current one, and the edge
+// interrupt is restored on wake.
+esp_err_t IRAM_ATTR powerLightSleepEnter(int64_t sleepTimeUs, void* arg) {
+  (void)sleepTimeUs;
+  (void)arg;
+  for (uint8_t i = 0; i < OPTO_CHANNEL_COUNT; i++) {
+    gpio_num_t pin = (gpio_num_t)optoPins[i];
+    gpio_wakeup_enable(pin, gpio_get_level(pin) ? GPIO_INTR_LOW_LEVEL
+                                                : GPIO_INTR_HIGH_LEVEL);
+  }
+  return ESP_OK;
+}
+
+esp_err_t IRAM_ATTR powerLightSleepExit(int64_t sleepTimeUs, void* arg) {
+  (void)arg;
+  for (uint8_t i = 0; i < OPTO_CHANNEL_COUNT; i++) {
+    gpio_num_t pin = (gpio_num_t)optoPins[i];
+    gpio_wakeup_disable(pin);
+    gpio_set_intr_type(pin, GPIO_INTR_ANYEDGE);
+  }
+  portENTER_CRITICAL_ISR(&powerSleepMux);
+  powerLightSleepUs += (uint64_t)sleepTimeUs;
+  portEXIT_CRITICAL_ISR(&powerSleepMux);
+  return ESP_OK;
+}
+#endif
+
+// 0 when the SDK cannot report light sleep.
+inline uint32_t powerLightSleepSeconds() {
+#if POWER_SLEEP_CALLBACKS
+  portENTER_CRITICAL(&powerSleepMux);
+  uint64_t us = powerLightSleepUs;
+  portEXIT_CRITICAL(&powerSleepMux);
+  return (uint32_t)(us / 1000000ULL);
+#else
+  return 0;
+#endif
+}
+
+void IRAM_ATTR powerWakeIsr() {
+  if (loopTaskHandle == nullptr) return;
+  BaseType_t woken = pdFALSE;
+  vTaskNotifyGiveFromISR(loopTaskHandle, &woken);
+  if (woken == pdTRUE) {
+    portYIELD_FROM_ISR();
+  }
+}
+
+inline void powerWakeLoop() {
+  if (loopTaskHandle != nullptr) {
+    xTaskNotifyGive(loopTaskHandle);
+  }
+}
+
+void powerBegin() {
+  loopTaskHandle = xTaskGetCurrentTaskHandle();
+  powerMarkUs = esp_timer_get_time();
+  if (!POWER_SAVE_ENABLED) return;
+
+  WiFi.setSleep(true);
+  Serial.onReceive(powerWakeLoop);
+
+  for (uint8_t i = 0; i < OPTO_CHANNEL_COUNT; i++) {
+    attachInterrupt(digitalPinToInterrupt(optoPins[i]), powerWakeIsr, CHANGE);
+  }
+  attachInterrupt(digitalPinToInterrupt(WIFI_CONFIG_PIN), powerWakeIsr, FALLING);
+
+#if CONFIG_PM_ENABLE
+#if ESP_IDF_VERSION_MAJOR >= 5
+  esp_pm_config_t pm = {};
+#else
+  esp_pm_config_esp32_t pm = {};
+#endif
+  pm.max_freq_mhz = (int)CPU_FREQ_ACTIVE_MHZ;
+  pm.min_freq_mhz = (int)CPU_FREQ_IDLE_MHZ;
+#if CONFIG_FREERTOS_USE_TICKLESS_IDLE
+  pm.light_sleep_enable = true;
+#endif
+  if (esp_pm_configure(&pm) == ESP_OK) {
+    esp_pm_lock_create(ESP_PM_CPU_FREQ_MAX, 0, "scanpay-relay", &powerCpuLock);
+  }
+  // Without the sleep callbacks the optos do not wake light sleep; their
+  // changes are picked up on the loop's next timed wake.
+#if POWER_SLEEP_CALLBACKS
+  esp_sleep_enable_gpio_wakeup();
+  esp_pm_sleep_cbs_register_config_t sleepCbs = {};
+  sleepCbs.enter_cb = powerLightSleepEnter;
+  sleepCbs.exit_cb = powerLightSleepExit;
+  esp_pm_light_sleep_register_cbs(&sleepCbs);
+#endif
+#endif
+}
+
+inline bool anyRelayActive() {
+  for (uint8_t ch = 0; ch < RELAY_CHANNEL_COUNT; ch++) {
+    if (relayState[ch]) return true;
+  }
+  return false;
+}
+
+inline void powerUpdateClock(bool relayActive) {
+  if (!POWER_SAVE_ENABLED || relayActive == powerHighClock) return;
+  powerHighClock = relayActive;
+  powerEnterState(relayActive ? POWER_STATE_ACTIVE : POWER_STATE_IDLE);
+#if CONFIG_PM_ENABLE
+  if (powerCpuLock != nullptr) {
+    if (relayActive) {
+      esp_pm_lock_acquire(powerCpuLock);
+    } else {
+      esp_pm_lock_release(powerCpuLock);
+    }
+    return;
+  }
+#endif
+  setCpuFrequencyMhz(relayActive ? CPU_FREQ_ACTIVE_MHZ : CPU_FREQ_IDLE_MHZ);
+}
+
+inline uint32_t earlierDeadline(uint32_t a, uint32_t b) {
+  return ((int32_t)(b - a) < 0) ? b : a;
+}
+
+// Only deadlines loop() can act on count. A past one would turn the wait
+// into a busy loop: an invoice needs Wi-Fi and a free channel, so while its
+// channel cools down the cooldown end is the next chance, and a command held
+// back by a fresh invoice waits for that invoice instead of its cooldown.
+inline uint32_t nextLoopWakeMs(uint32_t now) {
+  uint32_t maxWaitMs = configServerStarted ? POWER_LOOP_CONFIG_API_MAX_WAIT_MS
+                                           : POWER_LOOP_MAX_SLEEP_MS;
+  uint32_t wake = now + maxWaitMs;
+  wake = earlierDeadline(wake, lastStatusMs + STATUS_INTERVAL_MS);
+  bool wifiConnected = (WiFi.status() == WL_CONNECTED);
+  bool invoicesCanSend = wifiConnected && !invoiceJobBusy && invoiceJobQueue != nullptr;
+  const uint8_t capacity = (uint8_t)(sizeof(pendingInvoices) / sizeof(pendingInvoices[0]));
+  for (uint8_t i = 0; invoicesCanSend && i < pendingInvoiceCount; i++) {
+    const InvoiceRequest& req = pendingInvoices[(pendingInvoiceHead + i) % capacity];
+    int8_t ch = relayChannelForDevice(req.deviceIndex);
+    if (ch < 0 || relayState[ch]) continue;
+    wake = earlierDeadline(wake, channelAvailable((uint8_t)ch, now)
+                                   ? lastInvoiceAttemptMs + 1000U
+                                   : relayCooldownUntilMs[ch]);
+  }
+  for (uint8_t ch = 0; ch < RELAY_CHANNEL_COUNT; ch++) {
+    if (relayState[ch]) {
+      if (relayPhase[ch] == RELAY_PHASE_ACTIVE_WAIT) {
+        wake = earlierDeadline(wake, pulseUntilMs[ch]);
+      } else {
+        wake = earlierDeadline(wake, pulseEdgeMs[ch]);
+      }
+      if (relayWatchdogUntilMs[ch] > 0) {
+        wake = earlierDeadline(wake, relayWatchdogUntilMs[ch]);
+      }
+    } else if (hasPendingCommandForDevice(ch) &&
+               !(wifiConnected && hasFreshInvoiceRequestForDevice(ch))) {
+      wake = earlierDeadline(wake, relayCooldownUntilMs[ch]);
+    }
+  }
+  return wake;
+}
+
+// Blocks the loop task until the next relay edge, status tick or invoice slot.
+// Opto edges, the config pin and fresh poll results cut the wait short.
+inline void powerWaitUntil(uint32_t now, uint32_t wakeMs) {
+  int32_t waitMs = (int32_t)(wakeMs - now);
+  if (!POWER_SAVE_ENABLED || loopTaskHandle == nullptr || waitMs <= 0) return;
+  int64_t startedUs = esp_timer_get_time();
+  (void)ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS((uint32_t)waitMs));
+  powerBlockedUs += (uint64_t)(esp_timer_get_time() - startedUs);
+}
+
 inline void drainNetworkPollQueue() {
   if (networkPollQueue == nullptr) return;
   NetworkPollResult result;
@@ -734,28 +2557,25 @@ inline void drainNetworkPollQueue() {
   }
 }
 
-inline bool pollNextForDevice(const char* deviceId, uint8_t deviceIndex) {
+inline bool pollNextForDevice(const char* deviceId,
+                              uint8_t deviceIndex) {
   if (deviceIndex == 1 && !DEVICE2_ENABLED) return false;
   if (!deviceId || deviceId[0] == '\0' || networkPollQueue == nullptr) return false;
-  char url[128];
-  snprintf(url, sizeof(url), "http://%s:8000/api/device/%s/next/", HOST_IP, deviceId);
-  HTTPClient http;
-  http.setTimeout(HTTP_TIMEOUT_MS);
-  http.begin(url);
-  int code = http.GET();
+  char path[64];
+  snprintf(path, sizeof(path), "/api/device/%s/next/", deviceId);
+  String body;
+  int code = backendCall(pollLink, path, nullptr, HTTP_TIMEOUT_MS, body, true);
   if (code > 0) {
-    String body = http.getString();
     NetworkPollResult result;
     bool parsed = parseHttpBody(body, deviceIndex, deviceId, &result);
-    http.end();
     if (parsed) {
-      return (xQueueSend(networkPollQueue, &result, 0) == pdTRUE) &&
-             (result.type == NETWORK_POLL_COMMAND);
+      bool queued = (xQueueSend(networkPollQueue, &result, 0) == pdTRUE);
+      if (queued) {
+        powerWakeLoop();
+      }
+      return queued && (result.type == NETWORK_POLL_COMMAND);
     }
-    return false;
   }
-
-  http.end();
   return false;
 }
 
@@ -766,16 +2586,40 @@ void networkTask(void* parameter) {
     if (networkPollAllowed && WiFi.status() == WL_CONNECTED &&
         timeReached(now, lastPollMs + HTTP_POLL_INTERVAL_MS)) {
       lastPollMs = now;
-      (void)pollNextForDevice(DEVICE_ID, 0);
-      if (DEVICE2_ENABLED) {
-        (void)pollNextForDevice(DEVICE_ID2, 1);
+      RuntimeConfig cfg;
+      snapshotConfig(&cfg);
+      if (devicePollAllowed[0]) {
+        (void)pollNextForDevice(cfg.deviceId, 0);
       }
+      if (DEVICE2_ENABLED && devicePollAllowed[1]) {
+        (void)pollNextForDevice(cfg.deviceId2, 1);
+      }
+    }
+    persistConfigIfPending();
+    persistRelayCheckpointIfPending();
+    persistCommandDedupeIfPending();
+    // Wait for the next poll, but pick up an invoice job as soon as loop()
+    // hands one over.
+    int32_t untilPollMs = (int32_t)((lastPollMs + HTTP_POLL_INTERVAL_MS) - millis());
+    uint32_t waitMs = untilPollMs > 20 ? (uint32_t)untilPollMs : 20U;
+    InvoiceJob job;
+    if (invoiceJobQueue == nullptr) {
+      vTaskDelay(pdMS_TO_TICKS(waitMs));
+    } else if (xQueueReceive(invoiceJobQueue, &job, pdMS_TO_TICKS(waitMs)) == pdTRUE) {
+      InvoiceJobResult result;
+      runInvoiceJob(job, &result);
+      (void)xQueueSend(invoiceResultQueue, &result, 0);
+      powerWakeLoop();
     }
-    vTaskDelay(pdMS_TO_TICKS(20));
   }
 }
 
 void setup() {
+  for (uint8_t i = 0; i < RELAY_CHANNEL_COUNT; i++) {
+    pinMode(relayPins[i], OUTPUT);
+    relayWrite(i, false); // start OFF
+  }
+
   Serial.begin(115200);
 
   pinMode(WIFI_CONFIG_PIN, INPUT_PULLUP);
@@ -783,16 +2627,29 @@ void setup() {
   wifiConfigPinWasActive = forceConfigPortal;
 
   loadPrefs();
+  loadBackendEndpoints(activeConfig());
+  loadCommandDedupe();
 
-  if (connectWiFi(forceConfigPortal || WIFI_AP_CONFIG_ON_BOOT,
-                  WIFI_CONFIG_PORTAL_TIMEOUT_MS)) {
-    savePrefs();
+  // WiFiManager builds its pages on the stack of the task that runs it.
+  if (xTaskCreate(portalTask, "scanpay-portal", 8192, nullptr, 1,
+                  &portalTaskHandle) != pdPASS) {
+    portalTaskHandle = nullptr;
   }
-  
-  for (uint8_t i = 0; i < RELAY_CHANNEL_COUNT; i++) {
-    pinMode(relayPins[i], OUTPUT);
-    relayWrite(i, false); // start OFF
+
+  checkpointWriteLock = xSemaphoreCreateMutex();
+  if (recoverRelayTasks()) {
+    // A resumed hold needs loop() running, so skip the blocking boot portal
+    // and reconnect with the stored credentials in the background.
+    WiFi.mode(WIFI_STA);
+    WiFi.begin();
+    if (forceConfigPortal) {
+      startWiFiPortal();
+    }
+  } else {
+    (void)connectWiFi(forceConfigPortal || WIFI_AP_CONFIG_ON_BOOT,
+                      WIFI_CONFIG_PORTAL_TIMEOUT_MS);
   }
+  beginTimeSync();
 
   for (uint8_t i = 0; i < OPTO_CHANNEL_COUNT; i++) {
 #if OPTO_ACTIVE_LOW
@@ -803,12 +2660,23 @@ void setup() {
   }
 
   networkPollQueue = xQueueCreate(4, sizeof(NetworkPollResult));
-  if (networkPollQueue != nullptr &&
-      xTaskCreate(networkTask, "scanpay-net", 6144, nullptr, 1,
+  invoiceJobQueue = xQueueCreate(1, sizeof(InvoiceJob));
+  invoiceResultQueue = xQueueCreate(1, sizeof(InvoiceJobResult));
+  // Invoice HTTP and JSON parsing run in the network task too, hence the
+  // larger stack.
+  if (networkPollQueue == nullptr || invoiceJobQueue == nullptr ||
+      invoiceResultQueue == nullptr ||
+      xTaskCreate(networkTask, "scanpay-net", 8192, nullptr, 1,
                   &networkTaskHandle) != pdPASS) {
-    vQueueDelete(networkPollQueue);
+    if (networkPollQueue != nullptr) vQueueDelete(networkPollQueue);
+    if (invoiceJobQueue != nullptr) vQueueDelete(invoiceJobQueue);
+    if (invoiceResultQueue != nullptr) vQueueDelete(invoiceResultQueue);
     networkPollQueue = nullptr;
+    invoiceJobQueue = nullptr;
+    invoiceResultQueue = nullptr;
   }
+
+  powerBegin();
 }
 
 void loop() {
@@ -816,17 +2684,22 @@ void loop() {
   bool wifiConfigPinActive = (digitalRead(WIFI_CONFIG_PIN) == LOW);
 
   if (wifiConfigPinActive && !wifiConfigPinWasActive) {
-    networkPollAllowed = false;
-    if (connectWiFi(true)) {
-      savePrefs();
-    }
+    startWiFiPortal();
   }
   wifiConfigPinWasActive = wifiConfigPinActive;
+  applyPortalParams();
+  processConfigServer();
+  processUartCommands();
 
   updateRelayPulses(now);
+  trackSystemTimeSteps();
   drainNetworkPollQueue();
   processInvoiceRequests(now);
   processPendingCommands(now);
+  stageCommandDedupe();
+  reportTimeSync();
+  reportTransportStats(now);
+  reportBackendSelection();
 
   if (timeReached(now, lastStatusMs + STATUS_INTERVAL_MS)) {
     lastStatusMs = now;
@@ -843,7 +2716,19 @@ void loop() {
     Serial.print(activeTaskCount[0]);
     Serial.print(activeTaskCount[1]);
     Serial.print(" I");
-    Serial.print(pendingInvoiceCount);
+    Serial.print(pendingInvoiceCount + (invoiceJobBusy ? invoiceJobInFlight.count : 0));
+    Serial.print(" X");
+    Serial.print(droppedCommandCount);
+    Serial.print(" B");
+    Serial.print((int)backendPreferred);
+    Serial.print(" P");
+    Serial.print(powerStateSeconds(POWER_STATE_ACTIVE));
+    Serial.print("/");
+    Serial.print(powerStateSeconds(POWER_STATE_IDLE));
+    Serial.print("/");
+    Serial.print(powerBlockedSeconds());
+    Serial.print("/");
+    Serial.print(powerLightSleepSeconds());
     Serial.print(" O");
     Serial.print(optoReadTriggered(0) ? "1" : "0");
     Serial.print(optoReadTriggered(1) ? "1" : "0");
@@ -851,9 +2736,14 @@ void loop() {
     Serial.println(optoReadTriggered(3) ? "1" : "0");
   }
 
+  for (uint8_t i = 0; i < 2; i++) {
+    devicePollAllowed[i] =
+      (pendingCommandDeviceCount[i] < PENDING_COMMANDS_PER_DEVICE);
+  }
   networkPollAllowed = (!wifiConfigPinActive &&
-                        pendingCommandCount < RELAY_CHANNEL_COUNT &&
                         WiFi.status() == WL_CONNECTED);
 
-  (void)now;
+  powerUpdateClock(anyRelayActive());
+  uint32_t idleFromMs = millis();
+  powerWaitUntil(idleFromMs, nextLoopWakeMs(idleFromMs));
 }
@@ -0,0 +1,255 @@
+// Host stand-in for the Arduino-ESP32 core, just enough to compile
+// src/main.cpp for the native test environment. Time, pins and Wi-Fi state
+// are plain globals the tests drive directly.
+#pragma once
+
+#include <cctype>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <string>
+#include <utility>
+#include <vector>
+
+#define LOW 0
+#define HIGH 1
+#define INPUT 0x01
+#define OUTPUT 0x03
+#define INPUT_PULLUP 0x05
+#define INPUT_PULLDOWN 0x09
+#define FALLING 0x02
+#define CHANGE 0x03
+
+#define IRAM_ATTR
+#define RTC_NOINIT_ATTR
+#define RTC_DATA_ATTR
+
+// ----------------------- FreeRTOS -----------------------
+typedef void* QueueHandle_t;
+typedef void* TaskHandle_t;
+typedef void* SemaphoreHandle_t;
+typedef int BaseType_t;
+typedef uint32_t TickType_t;
+typedef int portMUX_TYPE;
+
+#define pdTRUE 1
+#define pdFALSE 0
+#define pdPASS 1
+#define portMAX_DELAY 0xffffffffUL
+#define pdMS_TO_TICKS(ms) ((TickType_t)(ms))
+#define portMUX_INITIALIZER_UNLOCKED 0
+
+inline void portENTER_CRITICAL(portMUX_TYPE*) {}
+inline void portEXIT_CRITICAL(portMUX_TYPE*) {}
+inline void portYIELD_FROM_ISR() {}
+// Queues are plain FIFOs that never block, so a test can play the other task
+// by sending or receiving on the same handle.
+struct ShimQueue {
+  size_t length;
+  size_t itemSize;
+  std::deque<std::vector<uint8_t>> items;
+};
+
+inline QueueHandle_t xQueueCreate(int length, size_t itemSize) {
+  return new ShimQueue{ (size_t)length, itemSize, {} };
+}
+inline BaseType_t xQueueSend(QueueHandle_t handle, const void* item, TickType_t) {
+  ShimQueue* q = (ShimQueue*)handle;
+  if (!q || q->items.size() >= q->length) return pdFALSE;
+  const uint8_t* bytes = (const uint8_t*)item;
+  q->items.emplace_back(bytes, bytes + q->itemSize);
+  return pdTRUE;
+}
+inline BaseType_t xQueueReceive(QueueHandle_t handle, void* item, TickType_t) {
+  ShimQueue* q = (ShimQueue*)handle;
+  if (!q || q->items.empty()) return pdFALSE;
+  memcpy(item, q->items.front().data(), q->itemSize);
+  q->items.pop_front();
+  return pdTRUE;
+}
+inline void vQueueDelete(QueueHandle_t handle) { delete (ShimQueue*)handle; }
+inline BaseType_t xTaskCreate(void (*)(void*), const char*, uint32_t, void*, int,
+                              TaskHandle_t*) {
+  return pdFALSE;
+}
+inline SemaphoreHandle_t xSemaphoreCreateMutex() { return nullptr; }
+inline BaseType_t xSemaphoreTake(SemaphoreHandle_t, TickType_t) { return pdTRUE; }
+inline BaseType_t xSemaphoreGive(SemaphoreHandle_t) { return pdTRUE; }
+inline void vTaskDelay(TickType_t) {}
+inline TaskHandle_t xTaskGetCurrentTaskHandle() { return nullptr; }
+inline uint32_t ulTaskNotifyTake(BaseType_t, TickType_t) { return 0; }
+inline BaseType_t xTaskNotifyGive(TaskHandle_t) { return pdPASS; }
+inline void vTaskNotifyGiveFromISR(TaskHandle_t, BaseType_t*) {}
+
+// ----------------------- Time and GPIO -----------------------
+inline uint32_t shimMillis = 0;
+inline uint8_t shimPinLevel[64] = {};
+inline uint32_t shimPinWrites = 0;
+
+inline uint32_t millis() { return shimMillis; }
+inline uint32_t micros() { return shimMillis * 1000UL; }
+inline void delay(uint32_t ms) { shimMillis += ms; }
+inline void pinMode(uint8_t, uint8_t) {}
+inline void digitalWrite(uint8_t pin, uint8_t level) {
+  shimPinLevel[pin & 63] = level;
+  shimPinWrites++;
+}
+inline int digitalRead(uint8_t pin) { return shimPinLevel[pin & 63] ? HIGH : LOW; }
+inline int digitalPinToInterrupt(uint8_t pin) { return pin; }
+inline void attachInterrupt(int, void (*)(), int) {}
+inline bool setCpuFrequencyMhz(uint32_t) { return true; }
+
+// ----------------------- String -----------------------
+// Mirrors the ESP32 WString buffer policy so allocation counts carry over:
+// up to 11 chars live inline, longer strings get a heap buffer sized
+// exactly, regrown on each concat that no longer fits. operator+ copies a
+// named left side and appends in place to a temporary one, as
+// StringSumHelper does, and assigning the result moves its buffer.
+class String {
+ public:
+  static const unsigned int SSO_CAPACITY = 11;
+
+  String() {}
+  String(const char* s) { assign(s ? s : "", s ? (unsigned int)strlen(s) : 0); }
+  String(const String& o) { assign(o.c_str(), o.len_); }
+  String(String&& o) noexcept { take(o); }
+  explicit String(char c) { assign(&c, 1); }
+  explicit String(int v) { format("%d", v); }
+  explicit String(unsigned int v) { format("%u", v); }
+  explicit String(long v) { format("%ld", v); }
+  explicit String(unsigned long v) { format("%lu", v); }
+  explicit String(long long v) { format("%lld", v); }
+  explicit String(unsigned long long v) { format("%llu", v); }
+  explicit String(float v, unsigned char decimals = 2) { format("%.*f", (int)decimals, (double)v); }
+  explicit String(double v, unsigned char decimals = 2) { format("%.*f", (int)decimals, v); }
+  ~String() { delete[] heap_; }
+
+  String& operator=(const String& o) {
+    if (this != &o) assign(o.c_str(), o.len_);
+    return *this;
+  }
+  String& operator=(String&& o) noexcept {
+    if (this != &o) {
+      delete[] heap_;
+      heap_ = nullptr;
+      take(o);
+    }
+    return *this;
+  }
+  String& operator=(const char* s) {
+    assign(s ? s : "", s ? (unsigned int)strlen(s) : 0);
+    return *this;
+  }
+
+  unsigned int length() const { return len_; }
+  const char* c_str() const { return heap_ ? heap_ : sso_; }
+  bool isEmpty() const { return len_ == 0; }
+  bool reserve(unsigned int size) {
+    if (size <= capacity()) return true;
+    char* grown = new char[size + 1];
+    memcpy(grown, c_str(), len_ + 1);
+    delete[] heap_;
+    heap_ = grown;
+    cap_ = size;
+    return true;
+  }
+  char operator[](unsigned int i) const { return i < len_ ? c_str()[i] : '\0'; }
+  int indexOf(const String& needle) const { return indexOf(needle.c_str()); }
+  int indexOf(const char* needle) const { return found(strstr(c_str(), needle)); }
+  int indexOf(char c, unsigned int from = 0) const {
+    return from >= len_ ? -1 : found(strchr(c_str() + from, c));
+  }
+
+  String& operator+=(const String& o) { return append(o.c_str(), o.len_); }
+  String& operator+=(const char* o) { return append(o, (unsigned int)strlen(o)); }
+  String& operator+=(char c) { return append(&c, 1); }
+  bool operator==(const String& o) const { return strcmp(c_str(), o.c_str()) == 0; }
+  bool operator==(const char* o) const { return strcmp(c_str(), o) == 0; }
+  bool operator!=(const char* o) const { return !(*this == o); }
+  friend String operator+(const String& a, const String& b) { String r(a); r += b; return r; }
+  friend String operator+(const String& a, const char* b) { String r(a); r += b; return r; }
+  friend String operator+(const char* a, const String& b) { String r(a); r += b; return r; }
+  friend String operator+(String&& a, const String& b) { a += b; return std::move(a); }
+  friend String operator+(String&& a, const char* b) { a += b; return std::move(a); }
+
+ private:
+  unsigned int capacity() const { return heap_ ? cap_ : SSO_CAPACITY; }
+  int found(const char* p) const { return p ? (int)(p - c_str()) : -1; }
+  void assign(const char* s, unsigned int n) {
+    if (n > capacity()) {
+      delete[] heap_;
+      heap_ = nullptr;
+      reserve(n);
+    }
+    char* dst = heap_ ? heap_ : sso_;
+    memmove(dst, s, n);
+    dst[n] = '\0';
+    len_ = n;
+  }
+  String& append(const char* s, unsigned int n) {
+    reserve(len_ + n);
+    char* dst = heap_ ? heap_ : sso_;
+    memmove(dst + len_, s, n);
+    len_ += n;
+    dst[len_] = '\0';
+    return *this;
+  }
+  void take(String& o) {
+    memcpy(sso_, o.sso_, sizeof(sso_));
+    heap_ = o.heap_;
+    cap_ = o.cap_;
+    len_ = o.len_;
+    o.heap_ = nullptr;
+    o.len_ = 0;
+    o.sso_[0] = '\0';
+  }
+  template <typename... Args>
+  void format(const char* fmt, Args... args) {
+    char buf[48];
+    int n = snprintf(buf, sizeof(buf), fmt, args...);
+    assign(buf, n < 0 ? 0 : (unsigned int)n);
+  }
+
+  char sso_[SSO_CAPACITY + 1] = {};
+  char* heap_ = nullptr;
+  unsigned int cap_ = 0;
+  unsigned int len_ = 0;
+};
+
+class IPAddress {
+ public:
+  bool fromString(const char* s) {
+    unsigned a, b, c, d;
+    char tail;
+    return s && sscanf(s, "%u.%u.%u.%u%c", &a, &b, &c, &d, &tail) == 4 &&
+           a < 256 && b < 256 && c < 256 && d < 256;
+  }
+};
+
+// ----------------------- Serial -----------------------
+// Output is discarded; tests feed input through shimSerialInput.
+inline std::string shimSerialInput;
+
+class HardwareSerial {
+ public:
+  void begin(unsigned long) {}
+  int available() { return (int)shimSerialInput.size(); }
+  int read() {
+    if (shimSerialInput.empty()) return -1;
+    int c = (unsigned char)shimSerialInput[0];
+    shimSerialInput.erase(0, 1);
+    return c;
+  }
+  void onReceive(std::function<void()>) {}
+  template <typename T>
+  size_t print(const T&) { return 0; }
+  template <typename T>
+  size_t println(const T&) { return 0; }
+  size_t println() { return 0; }
+};
+
+inline HardwareSerial Serial;
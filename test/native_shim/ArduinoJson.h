@@ -0,0 +1,288 @@
+#pragma once
+
+#include <Arduino.h>
+
+#include <memory>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Minimal stand-in for the ArduinoJson 6 API used by src/main.cpp: a small
+// recursive-descent parser into a shared tree, read through the same
+// operator[], operator| and is<>/as<> calls. Missing keys and indexes read
+// as null, like the real library.
+struct ShimJsonNode {
+  enum Type { NUL, BOOLEAN, NUMBER, STRING, ARRAY, OBJECT };
+  Type type = NUL;
+  std::string text;  // string value, or the literal for numbers and booleans
+  std::vector<std::pair<std::string, std::shared_ptr<ShimJsonNode>>> members;
+  std::vector<std::shared_ptr<ShimJsonNode>> items;
+};
+
+class JsonObject;
+
+class JsonVariant {
+ public:
+  JsonVariant() {}
+  explicit JsonVariant(std::shared_ptr<const ShimJsonNode> node) : node_(std::move(node)) {}
+
+  JsonVariant operator[](const char* key) const {
+    if (node_ && node_->type == ShimJsonNode::OBJECT) {
+      for (const auto& member : node_->members) {
+        if (member.first == key) return JsonVariant(member.second);
+      }
+    }
+    return JsonVariant();
+  }
+  JsonVariant operator[](size_t index) const {
+    if (node_ && node_->type == ShimJsonNode::ARRAY && index < node_->items.size()) {
+      return JsonVariant(node_->items[index]);
+    }
+    return JsonVariant();
+  }
+  const char* operator|(const char* def) const {
+    return isType(ShimJsonNode::STRING) ? node_->text.c_str() : def;
+  }
+  bool isNull() const { return !node_ || node_->type == ShimJsonNode::NUL; }
+
+  template <typename T>
+  bool is() const {
+    if (std::is_same<T, const char*>::value) return isType(ShimJsonNode::STRING);
+    if (std::is_same<T, JsonObject>::value) return isType(ShimJsonNode::OBJECT);
+    return false;
+  }
+  template <typename T>
+  T as() const;
+
+  const ShimJsonNode* node() const { return node_.get(); }
+
+ protected:
+  bool isType(ShimJsonNode::Type type) const { return node_ && node_->type == type; }
+
+  std::shared_ptr<const ShimJsonNode> node_;
+};
+
+class JsonString {
+ public:
+  explicit JsonString(const char* s = "") : s_(s) {}
+  const char* c_str() const { return s_; }
+
+ private:
+  const char* s_;
+};
+
+class JsonPair {
+ public:
+  JsonPair(const char* key, JsonVariant value) : key_(key), value_(std::move(value)) {}
+  JsonString key() const { return JsonString(key_); }
+  JsonVariant value() const { return value_; }
+
+ private:
+  const char* key_;
+  JsonVariant value_;
+};
+
+class JsonObject : public JsonVariant {
+ public:
+  JsonObject() {}
+  JsonObject(const JsonVariant& v) : JsonVariant(v) {
+    if (!isType(ShimJsonNode::OBJECT)) return;
+    for (const auto& member : node_->members) {
+      pairs_.emplace_back(member.first.c_str(), JsonVariant(member.second));
+    }
+  }
+  std::vector<JsonPair>::const_iterator begin() const { return pairs_.begin(); }
+  std::vector<JsonPair>::const_iterator end() const { return pairs_.end(); }
+
+ private:
+  std::vector<JsonPair> pairs_;
+};
+
+template <typename T>
+T JsonVariant::as() const {
+  if constexpr (std::is_same<T, const char*>::value) {
+    return isType(ShimJsonNode::STRING) ? node_->text.c_str() : nullptr;
+  } else {
+    return T(*this);
+  }
+}
+
+typedef JsonVariant JsonArray;
+
+class DynamicJsonDocument : public JsonVariant {
+ public:
+  explicit DynamicJsonDocument(size_t) {}
+  void shimSetRoot(std::shared_ptr<const ShimJsonNode> root) { node_ = std::move(root); }
+};
+
+class DeserializationError {
+ public:
+  explicit DeserializationError(const char* error = nullptr) : error_(error) {}
+  explicit operator bool() const { return error_ != nullptr; }
+  const char* c_str() const { return error_ ? error_ : "Ok"; }
+
+ private:
+  const char* error_;
+};
+
+class ShimJsonParser {
+ public:
+  explicit ShimJsonParser(const char* s) : p_(s) {}
+
+  std::shared_ptr<ShimJsonNode> parseDocument() {
+    std::shared_ptr<ShimJsonNode> root = parseValue(0);
+    skipSpace();
+    return (root && *p_ == '\0') ? root : nullptr;
+  }
+
+ private:
+  void skipSpace() {
+    while (*p_ == ' ' || *p_ == '\t' || *p_ == '\n' || *p_ == '\r') p_++;
+  }
+  bool literal(const char* word) {
+    size_t n = strlen(word);
+    if (strncmp(p_, word, n) != 0) return false;
+    p_ += n;
+    return true;
+  }
+  bool parseString(std::string* out) {
+    if (*p_ != '"') return false;
+    p_++;
+    while (*p_ != '"') {
+      if (*p_ == '\0' || (unsigned char)*p_ < 0x20) return false;
+      if (*p_ != '\\') {
+        *out += *p_++;
+        continue;
+      }
+      p_++;
+      switch (*p_) {
+        case '"': case '\\': case '/': *out += *p_; break;
+        case 'b': *out += '\b'; break;
+        case 'f': *out += '\f'; break;
+        case 'n': *out += '\n'; break;
+        case 'r': *out += '\r'; break;
+        case 't': *out += '\t'; break;
+        case 'u': {
+          unsigned code = 0;
+          for (int i = 1; i <= 4; i++) {
+            if (!isxdigit((unsigned char)p_[i])) return false;
+            code = code * 16 + (unsigned)(isdigit((unsigned char)p_[i])
+                                            ? p_[i] - '0'
+                                            : (tolower((unsigned char)p_[i]) - 'a' + 10));
+          }
+          *out += code < 0x80 ? (char)code : '?';
+          p_ += 4;
+          break;
+        }
+        default: return false;
+      }
+      p_++;
+    }
+    p_++;
+    return true;
+  }
+  std::shared_ptr<ShimJsonNode> parseValue(int depth) {
+    if (depth > 16) return nullptr;
+    skipSpace();
+    auto node = std::make_shared<ShimJsonNode>();
+    if (*p_ == '{') {
+      p_++;
+      node->type = ShimJsonNode::OBJECT;
+      skipSpace();
+      if (*p_ == '}') {
+        p_++;
+        return node;
+      }
+      for (;;) {
+        skipSpace();
+        std::string key;
+        if (!parseString(&key)) return nullptr;
+        skipSpace();
+        if (*p_++ != ':') return nullptr;
+        std::shared_ptr<ShimJsonNode> value = parseValue(depth + 1);
+        if (!value) return nullptr;
+        node->members.emplace_back(key, value);
+        skipSpace();
+        if (*p_ == ',') {
+          p_++;
+          continue;
+        }
+        if (*p_++ != '}') return nullptr;
+        return node;
+      }
+    }
+    if (*p_ == '[') {
+      p_++;
+      node->type = ShimJsonNode::ARRAY;
+      skipSpace();
+      if (*p_ == ']') {
+        p_++;
+        return node;
+      }
+      for (;;) {
+        std::shared_ptr<ShimJsonNode> value = parseValue(depth + 1);
+        if (!value) return nullptr;
+        node->items.push_back(value);
+        skipSpace();
+        if (*p_ == ',') {
+          p_++;
+          continue;
+        }
+        if (*p_++ != ']') return nullptr;
+        return node;
+      }
+    }
+    if (*p_ == '"') {
+      node->type = ShimJsonNode::STRING;
+      return parseString(&node->text) ? node : nullptr;
+    }
+    for (const char* word : { "true", "false" }) {
+      if (literal(word)) {
+        node->type = ShimJsonNode::BOOLEAN;
+        node->text = word;
+        return node;
+      }
+    }
+    if (literal("null")) return node;
+    const char* start = p_;
+    if (*p_ == '-') p_++;
+    if (!isdigit((unsigned char)*p_)) return nullptr;
+    while (isdigit((unsigned char)*p_) || *p_ == '.' || *p_ == 'e' || *p_ == 'E' ||
+           ((*p_ == '+' || *p_ == '-') && (p_[-1] == 'e' || p_[-1] == 'E'))) {
+      p_++;
+    }
+    node->type = ShimJsonNode::NUMBER;
+    node->text.assign(start, (size_t)(p_ - start));
+    return node;
+  }
+
+  const char* p_;
+};
+
+inline DeserializationError deserializeJson(DynamicJsonDocument& doc, const String& input) {
+  std::shared_ptr<ShimJsonNode> root = ShimJsonParser(input.c_str()).parseDocument();
+  if (!root) {
+    doc.shimSetRoot(nullptr);
+    return DeserializationError(input.isEmpty() ? "EmptyInput" : "InvalidInput");
+  }
+  doc.shimSetRoot(root);
+  return DeserializationError();
+}
+
+// Scalars only, which is all the config API serializes.
+inline size_t serializeJson(const JsonVariant& value, char* buf, size_t size) {
+  const ShimJsonNode* node = value.node();
+  std::string text = "null";
+  if (node && node->type == ShimJsonNode::STRING) {
+    text = "\"" + node->text + "\"";
+  } else if (node && (node->type == ShimJsonNode::NUMBER ||
+                      node->type == ShimJsonNode::BOOLEAN)) {
+    text = node->text;
+  }
+  if (size == 0) return 0;
+  size_t n = text.size() < size - 1 ? text.size() : size - 1;
+  memcpy(buf, text.data(), n);
+  buf[n] = '\0';
+  return n;
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <WiFi.h>
+
+#define HTTPC_ERROR_CONNECTION_REFUSED (-1)
+#define HTTPC_ERROR_SEND_HEADER_FAILED (-2)
+#define HTTPC_ERROR_NOT_CONNECTED (-4)
+#define HTTPC_ERROR_CONNECTION_LOST (-5)
+#define HTTPC_ERROR_READ_TIMEOUT (-11)
+
+// Requests go to shimHttpHandler over the client passed to begin(); without
+// a handler, or without a connected client, every request fails as if the
+// backend were unreachable. A negative handler result drops the connection.
+inline std::function<int(const std::string& host, uint16_t port, const char* method,
+                         const std::string& url, const std::string& body,
+                         std::string& response)>
+    shimHttpHandler;
+
+class HTTPClient {
+ public:
+  bool begin(const String&) { return false; }
+  bool begin(const char*) { return false; }
+  bool begin(WiFiClient& client, const String& url) {
+    client_ = &client;
+    url_ = url.c_str();
+    return true;
+  }
+  void setTimeout(uint16_t) {}
+  void setConnectTimeout(int32_t) {}
+  void setReuse(bool) {}
+  void addHeader(const String&, const String&) {}
+  int GET() { return send("GET", std::string()); }
+  int POST(const String& body) { return send("POST", body.c_str()); }
+  String getString() { return String(response_.c_str()); }
+  void end() {
+    client_ = nullptr;
+    response_.clear();
+  }
+
+ private:
+  int send(const char* method, const std::string& body) {
+    response_.clear();
+    if (!client_ || !client_->connected() || !shimHttpHandler) {
+      return HTTPC_ERROR_CONNECTION_REFUSED;
+    }
+    int code = shimHttpHandler(client_->shimHost(), client_->shimPort(), method, url_,
+                               body, response_);
+    if (code <= 0) client_->stop();
+    return code;
+  }
+
+  WiFiClient* client_ = nullptr;
+  std::string url_;
+  std::string response_;
+};
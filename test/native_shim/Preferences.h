@@ -0,0 +1,74 @@
+#pragma once
+
+#include <Arduino.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+// NVS stand-in. begin() fails unless a test sets shimPrefsAvailable, so load
+// and save paths stay no-ops by default. Values are kept as raw bytes per
+// "namespace/key" in shimPrefsStore, which tests can inspect or clear.
+inline bool shimPrefsAvailable = false;
+inline std::map<std::string, std::vector<uint8_t>> shimPrefsStore;
+inline uint32_t shimPrefsWrites = 0;
+
+class Preferences {
+ public:
+  bool begin(const char* ns, bool readOnly = false) {
+    if (!shimPrefsAvailable) return false;
+    ns_ = ns;
+    readOnly_ = readOnly;
+    return true;
+  }
+  void end() { ns_ = std::string(); }
+
+  size_t getString(const char* key, char* value, size_t maxLen) {
+    const std::vector<uint8_t>* v = find(key);
+    if (!v || !value || v->size() > maxLen) return 0;
+    memcpy(value, v->data(), v->size());
+    return v->size();
+  }
+  float getFloat(const char* key, float def = 0) { return get(key, def); }
+  int32_t getInt(const char* key, int32_t def = 0) { return get(key, def); }
+  size_t getBytes(const char* key, void* buf, size_t maxLen) {
+    const std::vector<uint8_t>* v = find(key);
+    if (!v || !buf || v->size() > maxLen) return 0;
+    memcpy(buf, v->data(), v->size());
+    return v->size();
+  }
+
+  size_t putString(const char* key, const char* value) {
+    return put(key, value, strlen(value) + 1);
+  }
+  size_t putFloat(const char* key, float value) { return put(key, &value, sizeof(value)); }
+  size_t putInt(const char* key, int32_t value) { return put(key, &value, sizeof(value)); }
+  size_t putBytes(const char* key, const void* value, size_t len) {
+    return put(key, value, len);
+  }
+
+ private:
+  const std::vector<uint8_t>* find(const char* key) const {
+    if (ns_.empty()) return nullptr;
+    auto it = shimPrefsStore.find(ns_ + "/" + key);
+    return it == shimPrefsStore.end() ? nullptr : &it->second;
+  }
+  template <typename T>
+  T get(const char* key, T def) {
+    const std::vector<uint8_t>* v = find(key);
+    if (!v || v->size() != sizeof(T)) return def;
+    T value;
+    memcpy(&value, v->data(), sizeof(T));
+    return value;
+  }
+  size_t put(const char* key, const void* value, size_t len) {
+    if (ns_.empty() || readOnly_) return 0;
+    const uint8_t* bytes = (const uint8_t*)value;
+    shimPrefsStore[ns_ + "/" + key].assign(bytes, bytes + len);
+    shimPrefsWrites++;
+    return len;
+  }
+
+  std::string ns_;
+  bool readOnly_ = false;
+};
@@ -0,0 +1,17 @@
+#pragma once
+
+#include <WiFi.h>
+
+enum HTTPMethod { HTTP_ANY, HTTP_GET, HTTP_POST };
+
+class WebServer {
+ public:
+  explicit WebServer(int) {}
+  void on(const char*, HTTPMethod, std::function<void()>) {}
+  void collectHeaders(const char**, size_t) {}
+  void begin() {}
+  void handleClient() {}
+  String header(const char*) { return String(); }
+  String arg(const char*) { return String(); }
+  void send(int, const char*, const String&) {}
+};
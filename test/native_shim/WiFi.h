@@ -0,0 +1,47 @@
+#pragma once
+
+#include <Arduino.h>
+
+#define WIFI_STA 1
+
+enum { WL_IDLE_STATUS = 0, WL_CONNECTED = 3, WL_DISCONNECTED = 6 };
+
+inline int shimWiFiStatus = WL_DISCONNECTED;
+
+// Connections succeed only when a test installs shimConnectHandler; it sees
+// every new connection, so tests can count handshakes per host and port.
+inline std::function<bool(const char* host, uint16_t port)> shimConnectHandler;
+
+class WiFiClient {
+ public:
+  virtual ~WiFiClient() {}
+  int connect(const char* host, uint16_t port) { return connect(host, port, 0); }
+  int connect(const char* host, uint16_t port, int32_t) {
+    stop();
+    open_ = shimConnectHandler && shimConnectHandler(host, port);
+    if (open_) {
+      host_ = host;
+      port_ = port;
+    }
+    return open_ ? 1 : 0;
+  }
+  uint8_t connected() { return open_ ? 1 : 0; }
+  void stop() { open_ = false; }
+  const std::string& shimHost() const { return host_; }
+  uint16_t shimPort() const { return port_; }
+
+ private:
+  bool open_ = false;
+  std::string host_;
+  uint16_t port_ = 0;
+};
+
+class WiFiClass {
+ public:
+  int status() { return shimWiFiStatus; }
+  bool mode(int) { return true; }
+  bool setSleep(bool) { return true; }
+  bool begin() { return true; }
+};
+
+inline WiFiClass WiFi;
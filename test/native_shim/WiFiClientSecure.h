@@ -0,0 +1,13 @@
+#pragma once
+
+#include <WiFi.h>
+
+inline bool shimTlsPinMatches = true;
+
+class WiFiClientSecure : public WiFiClient {
+ public:
+  void setInsecure() {}
+  void setCACert(const char*) {}
+  void setHandshakeTimeout(unsigned long) {}
+  bool verify(const char*, const char*) { return shimTlsPinMatches; }
+};
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <WiFi.h>
+
+class WiFiManagerParameter {
+ public:
+  WiFiManagerParameter(const char*, const char*, const char* value, int)
+    : value_(value) {}
+  const char* getValue() const { return value_; }
+  void setValue(const char* value, int) { value_ = value; }
+
+ private:
+  const char* value_;
+};
+
+class WiFiManager {
+ public:
+  void setConfigPortalTimeout(unsigned long) {}
+  void setConfigPortalBlocking(bool) {}
+  void setSaveConnect(bool) {}
+  void setConnectTimeout(unsigned long) {}
+  void setSaveParamsCallback(std::function<void()>) {}
+  void addParameter(WiFiManagerParameter*) {}
+  bool startConfigPortal(const char*) { return false; }
+  bool autoConnect(const char*) { return false; }
+  bool process() { return false; }
+  bool getConfigPortalActive() { return false; }
+};
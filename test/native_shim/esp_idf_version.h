@@ -0,0 +1,3 @@
+#pragma once
+
+#define ESP_IDF_VERSION_MAJOR 4
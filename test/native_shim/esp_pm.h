@@ -0,0 +1,2 @@
+#pragma once
+// CONFIG_PM_ENABLE is never set on the host, so nothing here is referenced.
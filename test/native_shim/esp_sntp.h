@@ -0,0 +1,9 @@
+#pragma once
+
+#include <sys/time.h>
+
+#include <cstdint>
+
+inline void sntp_set_time_sync_notification_cb(void (*)(struct timeval*)) {}
+inline void sntp_set_sync_interval(uint32_t) {}
+inline void configTime(long, int, const char*, const char* = nullptr) {}
@@ -0,0 +1,132 @@
+// Host microbenchmarks for the loop() hot paths. Numbers are for spotting
+// regressions between commits on the same machine, not for predicting ESP32
+// timings. Each result prints as "BENCH <name> <ns/op> ns/op <allocs> allocs/op".
+#include <unity.h>
+
+#include <chrono>
+#include <cstdlib>
+#include <new>
+
+#include "../../src/main.cpp"
+
+static size_t benchAllocCount = 0;
+
+void* operator new(size_t size) {
+  benchAllocCount++;
+  void* p = malloc(size ? size : 1);
+  if (!p) throw std::bad_alloc();
+  return p;
+}
+
+// Out of line so GCC cannot pair the free() with the operator new it inlines
+// elsewhere and report a false -Wmismatched-new-delete.
+__attribute__((noinline)) void operator delete(void* p) noexcept { free(p); }
+
+__attribute__((noinline)) void operator delete(void* p, size_t) noexcept { free(p); }
+
+static volatile uint32_t benchSink = 0;
+
+template <typename Fn>
+static double runBench(const char* name, uint32_t iterations, Fn fn) {
+  for (uint32_t i = 0; i < iterations / 10; i++) fn(i);
+  size_t allocsBefore = benchAllocCount;
+  auto start = std::chrono::steady_clock::now();
+  for (uint32_t i = 0; i < iterations; i++) fn(i);
+  auto elapsed = std::chrono::steady_clock::now() - start;
+  double nsPerOp = std::chrono::duration<double, std::nano>(elapsed).count() / iterations;
+  double allocsPerOp = (double)(benchAllocCount - allocsBefore) / iterations;
+  printf("BENCH %s %.1f ns/op %.2f allocs/op\n", name, nsPerOp, allocsPerOp);
+  return allocsPerOp;
+}
+
+void setUp() {
+  for (uint8_t d = 0; d < 2; d++) {
+    pendingCommandHead[d] = 0;
+    pendingCommandDeviceCount[d] = 0;
+  }
+  pendingCommandCount = 0;
+  pendingInvoiceHead = 0;
+  pendingInvoiceTail = 0;
+  pendingInvoiceCount = 0;
+  shimWiFiStatus = WL_DISCONNECTED;
+  shimMillis = 0;
+}
+
+void tearDown() {}
+
+void bench_time_reached() {
+  double allocs = runBench("timeReached", 10000000, [](uint32_t i) {
+    benchSink += timeReached(0xFFFFF000UL + i, 0xFFFFF800UL) ? 1 : 0;
+  });
+  TEST_ASSERT_EQUAL(0, allocs);
+}
+
+// The shim String keeps the device's 11-char inline buffer, so the needle
+// "\"command_id\":" (13 chars) costs one heap buffer per lookup.
+void bench_json_int() {
+  String body("{\"has_command\": true, \"action\": 1, \"duration_sec\": 5, \"command_id\": 123456}");
+  double allocs = runBench("jsonInt", 1000000, [&](uint32_t) {
+    int value = 0;
+    jsonInt(body, "command_id", &value);
+    benchSink += (uint32_t)value;
+  });
+  TEST_ASSERT_EQUAL(1, allocs);
+}
+
+void bench_parse_http_body() {
+  String body("{\"has_command\": true, \"action\": 1, \"duration_sec\": 5, \"command_id\": 123456}");
+  double allocs = runBench("parseHttpBody", 500000, [&](uint32_t i) {
+    NetworkPollResult result;
+    parseHttpBody(body, (uint8_t)(i & 1), "DEV001", &result);
+    benchSink += (uint32_t)result.commandId;
+  });
+  // "has_command" twice and "duration_sec" outgrow the inline buffer while
+  // the key is appended and again for "\":" (2 each); "command_id" only on
+  // the suffix (1); "action" fits.
+  TEST_ASSERT_EQUAL(7, allocs);
+}
+
+void bench_pending_command_fifo() {
+  double allocs = runBench("enqueue+dequeuePendingCommand", 5000000, [](uint32_t i) {
+    uint8_t device = (uint8_t)(i & 1);
+    PendingCommand out = {};
+    enqueuePendingCommand(device, 5000, "DEV001", (int32_t)i, 0);
+    dequeuePendingCommand(device, &out);
+    benchSink += (uint32_t)out.commandId;
+  });
+  TEST_ASSERT_EQUAL(0, allocs);
+}
+
+void bench_dequeue_invoice_request_at() {
+  InvoiceRequest req;
+  memset(&req, 0, sizeof(req));
+  double allocs = runBench("dequeueInvoiceRequestAt", 5000000, [&](uint32_t i) {
+    while (pendingInvoiceCount < 4) {
+      req.trace.commandId = (int32_t)i;
+      enqueueInvoiceRequest(req);
+    }
+    InvoiceRequest out = {};
+    dequeueInvoiceRequestAt((uint8_t)(i % 4), &out);
+    benchSink += (uint32_t)out.trace.commandId;
+  });
+  TEST_ASSERT_EQUAL(0, allocs);
+}
+
+void bench_update_relay_pulses() {
+  startRelayPulse(0, 0x10000000UL, 0, 0, "DEV001", 1, 0);
+  double allocs = runBench("updateRelayPulses", 5000000, [](uint32_t i) {
+    updateRelayPulses(RELAY_PULSE_MS + 1 + (i & 0xFFFF));
+  });
+  TEST_ASSERT_EQUAL(0, allocs);
+}
+
+int main() {
+  UNITY_BEGIN();
+  RUN_TEST(bench_time_reached);
+  RUN_TEST(bench_json_int);
+  RUN_TEST(bench_parse_http_body);
+  RUN_TEST(bench_pending_command_fifo);
+  RUN_TEST(bench_dequeue_invoice_request_at);
+  RUN_TEST(bench_update_relay_pulses);
+  return UNITY_END();
+}
@@ -0,0 +1,1232 @@
+// Property tests for the firmware hot paths, compiled for the host against
+// test/native_shim. Each test drives the real functions from src/main.cpp
+// with seeded random sequences and checks them against a simple model.
+#include <unity.h>
+
+#include <deque>
+#include <map>
+#include <random>
+#include <set>
+#include <vector>
+
+#include "../../src/main.cpp"
+
+static const uint32_t SEEDS[] = { 1, 7, 42, 1337, 20260418 };
+
+static void resetCoreState() {
+  for (uint8_t d = 0; d < 2; d++) {
+    pendingCommandHead[d] = 0;
+    pendingCommandDeviceCount[d] = 0;
+    activeTaskCount[d] = 0;
+    commandDedupe[d].highestId = -1;
+    commandDedupe[d].seenMask = 0;
+    lastRejectedCommandId[d] = -1;
+  }
+  pendingCommandCount = 0;
+  pendingInvoiceHead = 0;
+  pendingInvoiceTail = 0;
+  pendingInvoiceCount = 0;
+  for (uint8_t ch = 0; ch < RELAY_CHANNEL_COUNT; ch++) {
+    relayState[ch] = false;
+    relayPhase[ch] = RELAY_PHASE_IDLE;
+    pulseUntilMs[ch] = 0;
+    pulseEdgeMs[ch] = 0;
+    relayCooldownUntilMs[ch] = 0;
+    relayWatchdogUntilMs[ch] = 0;
+    relayDeviceIndex[ch] = -1;
+    relayHoldUntilUs[ch] = 0;
+    memset(&relayTrace[ch], 0, sizeof(relayTrace[ch]));
+    relayDeviceId[ch][0] = '\0';
+  }
+  commandDedupeDirty = false;
+  commandDedupePersistPending = false;
+  memset(&rtcCheckpoint, 0, sizeof(rtcCheckpoint));
+  checkpointPersistPending = false;
+  shimPrefsAvailable = false;
+  shimPrefsStore.clear();
+  shimPrefsWrites = 0;
+  configSlots[0] = CONFIG_DEFAULTS;
+  configSlots[1] = CONFIG_DEFAULTS;
+  activeConfigSlot = 0;
+  droppedCommandCount = 0;
+  lastInvoiceAttemptMs = 0;
+  invoiceJobBusy = false;
+  invoiceJobQueue = nullptr;
+  invoiceResultQueue = nullptr;
+  lastStatusMs = 0;
+  invoiceBatchSupported = INVOICE_BATCH_ENABLED;
+  BackendLink* links[] = { &pollLink, &invoiceLink, &probeLink };
+  for (BackendLink* link : links) {
+    link->http.end();
+    backendClient(*link).stop();
+    memset(&link->endpoint, 0, sizeof(link->endpoint));
+    link->connects = 0;
+    link->connectMs = 0;
+    link->requests = 0;
+    link->failures = 0;
+  }
+  shimConnectHandler = nullptr;
+  shimHttpHandler = nullptr;
+  backendLastProbeMs = 0;
+  loadBackendEndpoints(CONFIG_DEFAULTS);
+  shimWiFiStatus = WL_DISCONNECTED;
+  shimMillis = 0;
+}
+
+void setUp() { resetCoreState(); }
+
+void tearDown() {}
+
+static BackendEndpoint endpointFor(const char* host, uint16_t port = 0) {
+  BackendEndpoint endpoint;
+  memset(&endpoint, 0, sizeof(endpoint));
+  strncpy(endpoint.host, host, sizeof(endpoint.host) - 1);
+  endpoint.port = port ? port : backendPort();
+  return endpoint;
+}
+
+static NetworkPollResult makeCommand(uint8_t deviceIndex, bool action,
+                                     int durationSec, int commandId) {
+  NetworkPollResult result;
+  memset(&result, 0, sizeof(result));
+  result.type = NETWORK_POLL_COMMAND;
+  result.deviceIndex = deviceIndex;
+  result.action = action;
+  result.durationSec = durationSec;
+  result.hasCommandId = commandId >= 0;
+  result.commandId = commandId;
+  result.receivedMs = millis();
+  strncpy(result.deviceId, deviceIndex == 0 ? "DEV001" : "DEV002",
+          sizeof(result.deviceId));
+  return result;
+}
+
+// timeReached() must order any two stamps less than 2^31 ms apart, including
+// across the 49-day millis() rollover.
+void test_time_reached_wraparound() {
+  std::mt19937 rng(SEEDS[0]);
+  std::uniform_int_distribution<uint32_t> any;
+  std::uniform_int_distribution<uint32_t> delta(0, 0x7FFFFFFEUL);
+  for (int i = 0; i < 200000; i++) {
+    uint32_t target = (i % 4 == 0) ? 0xFFFFFFFFUL - delta(rng) % 5000 : any(rng);
+    uint32_t d = delta(rng);
+    TEST_ASSERT_TRUE(timeReached(target + d, target));
+    TEST_ASSERT_FALSE(timeReached(target - d - 1, target));
+  }
+}
+
+void test_json_int_matches_reference() {
+  for (uint32_t seed : SEEDS) {
+    std::mt19937 rng(seed);
+    std::uniform_int_distribution<int> value(-2000000000, 2000000000);
+    std::uniform_int_distribution<int> spaces(0, 3);
+    for (int i = 0; i < 5000; i++) {
+      int expected = value(rng);
+      std::string body = "{\"has_command\":true,\"action\":1,";
+      body += "\"command_id\":";
+      for (int s = spaces(rng); s > 0; s--) body += (s % 2) ? ' ' : '\t';
+      body += std::to_string(expected) + ",\"duration_sec\":5}";
+      int parsed = 0;
+      TEST_ASSERT_TRUE(jsonInt(String(body.c_str()), "command_id", &parsed));
+      TEST_ASSERT_EQUAL_INT(expected, parsed);
+    }
+  }
+
+  int out = 7;
+  TEST_ASSERT_FALSE(jsonInt(String("{\"command_id\":\"x\"}"), "command_id", &out));
+  TEST_ASSERT_FALSE(jsonInt(String("{}"), "command_id", &out));
+  TEST_ASSERT_EQUAL_INT(7, out);
+}
+
+void test_parse_http_body_round_trip() {
+  std::mt19937 rng(SEEDS[1]);
+  std::uniform_int_distribution<int> duration(-5, 600);
+  std::uniform_int_distribution<int> id(-3, 1000000);
+  for (int i = 0; i < 5000; i++) {
+    uint8_t device = (uint8_t)(i % 2);
+    int dur = duration(rng);
+    int cmdId = id(rng);
+    bool action = (i % 3) != 0;
+    std::string body = "{\"has_command\": true, \"action\": " +
+                       std::to_string(action ? 1 : 0) +
+                       ", \"duration_sec\": " + std::to_string(dur) +
+                       ", \"command_id\": " + std::to_string(cmdId) + "}";
+    NetworkPollResult result;
+    TEST_ASSERT_TRUE(parseHttpBody(String(body.c_str()), device,
+                                   device == 0 ? "DEV001" : "DEV002", &result));
+    TEST_ASSERT_EQUAL(NETWORK_POLL_COMMAND, result.type);
+    TEST_ASSERT_EQUAL(device, result.deviceIndex);
+    TEST_ASSERT_EQUAL(action, result.action);
+    TEST_ASSERT_EQUAL_INT(dur < 0 ? 0 : dur, result.durationSec);
+    TEST_ASSERT_EQUAL(cmdId >= 0, result.hasCommandId);
+    TEST_ASSERT_EQUAL_INT(cmdId >= 0 ? cmdId : -1, result.commandId);
+  }
+
+  NetworkPollResult result;
+  TEST_ASSERT_TRUE(parseHttpBody(String("{\"has_command\":false}"), 0, "DEV001", &result));
+  TEST_ASSERT_EQUAL(NETWORK_POLL_NO_COMMAND, result.type);
+  TEST_ASSERT_FALSE(parseHttpBody(String("<html>502</html>"), 0, "DEV001", &result));
+  TEST_ASSERT_FALSE(parseHttpBody(String("{\"has_command\":false}"), 2, "DEV003", &result));
+}
+
+void test_invoice_ring_matches_model() {
+  const uint8_t capacity = (uint8_t)(sizeof(pendingInvoices) / sizeof(pendingInvoices[0]));
+  for (uint32_t seed : SEEDS) {
+    resetCoreState();
+    std::mt19937 rng(seed);
+    std::deque<int32_t> model;
+    int32_t nextId = 0;
+    for (int i = 0; i < 20000; i++) {
+      int op = (int)(rng() % 3);
+      if (op == 0) {
+        InvoiceRequest req;
+        memset(&req, 0, sizeof(req));
+        req.deviceIndex = (uint8_t)(rng() % 2);
+        req.trace.commandId = nextId++;
+        bool accepted = enqueueInvoiceRequest(req);
+        TEST_ASSERT_EQUAL(model.size() < capacity, accepted);
+        if (accepted) model.push_back(req.trace.commandId);
+      } else if (op == 1) {
+        uint8_t offset = (uint8_t)(rng() % (capacity + 1));
+        InvoiceRequest out = {};
+        bool removed = dequeueInvoiceRequestAt(offset, &out);
+        TEST_ASSERT_EQUAL(offset < model.size(), removed);
+        if (removed) {
+          TEST_ASSERT_EQUAL_INT(model[offset], out.trace.commandId);
+          model.erase(model.begin() + offset);
+        }
+      } else {
+        InvoiceRequest out = {};
+        bool peeked = peekInvoiceRequest(&out);
+        TEST_ASSERT_EQUAL(!model.empty(), peeked);
+        if (peeked) {
+          TEST_ASSERT_EQUAL_INT(model.front(), out.trace.commandId);
+          popInvoiceRequest();
+          model.pop_front();
+        }
+      }
+      TEST_ASSERT_EQUAL(model.size(), pendingInvoiceCount);
+    }
+  }
+}
+
+void test_command_fifo_matches_model() {
+  for (uint32_t seed : SEEDS) {
+    resetCoreState();
+    std::mt19937 rng(seed);
+    std::deque<int32_t> model[2];
+    int32_t nextId = 0;
+    for (int i = 0; i < 20000; i++) {
+      uint8_t device = (uint8_t)(rng() % 2);
+      int op = (int)(rng() % 5);
+      if (op <= 1) {
+        bool accepted = enqueuePendingCommand(device, 1000, "DEV", nextId, 0);
+        TEST_ASSERT_EQUAL(model[device].size() < PENDING_COMMANDS_PER_DEVICE, accepted);
+        if (accepted) model[device].push_back(nextId);
+        nextId++;
+      } else if (op <= 3) {
+        PendingCommand out;
+        bool dequeued = dequeuePendingCommand(device, &out);
+        TEST_ASSERT_EQUAL(!model[device].empty(), dequeued);
+        if (dequeued) {
+          TEST_ASSERT_EQUAL_INT(model[device].front(), out.commandId);
+          TEST_ASSERT_EQUAL(device, out.deviceIndex);
+          model[device].pop_front();
+        }
+      } else {
+        cancelPendingCommandsForDevice(device);
+        model[device].clear();
+      }
+      TEST_ASSERT_EQUAL(model[0].size() + model[1].size(), pendingCommandCount);
+      TEST_ASSERT_EQUAL(!model[device].empty(), hasPendingCommandForDevice(device));
+      for (size_t k = 0; k < model[device].size(); k++) {
+        TEST_ASSERT_TRUE(commandIdInFlight(device, model[device][k]));
+      }
+    }
+  }
+}
+
+// Reference: an id is seen if it was recorded, or if it is at least
+// COMMAND_DEDUPE_WINDOW below the highest recorded id. Only an explicit
+// reset starts the window over.
+void test_dedupe_window_matches_model() {
+  for (uint32_t seed : SEEDS) {
+    resetCoreState();
+    std::mt19937 rng(seed);
+    std::set<int32_t> recorded;
+    int32_t highest = -1;
+    for (int i = 0; i < 20000; i++) {
+      int32_t base = highest < 0 ? 0 : highest;
+      int32_t id = base + (int32_t)(rng() % 80) - 50;
+      if (id < 0) id = (int32_t)(rng() % 8);
+      // Now and then a stale id far below the window, or an explicit reset.
+      if (highest > 100 && rng() % 500 == 0) id = (int32_t)(rng() % 8);
+      if (rng() % 2000 == 0) {
+        resetCommandDedupe(0);
+        highest = -1;
+        recorded.clear();
+      }
+
+      bool expectedSeen = highest >= 0 && id <= highest &&
+                          (highest - id >= COMMAND_DEDUPE_WINDOW || recorded.count(id) > 0);
+      TEST_ASSERT_EQUAL(expectedSeen, commandIdSeen(0, id));
+
+      if (rng() % 2) {
+        recordCommandId(0, id);
+        if (highest < 0 || id > highest) highest = id;
+        if (highest - id < COMMAND_DEDUPE_WINDOW) recorded.insert(id);
+        TEST_ASSERT_TRUE(commandIdSeen(0, id));
+      }
+    }
+    TEST_ASSERT_FALSE(commandIdSeen(1, 0));
+  }
+}
+
+// A single stale id must not reopen the window for other replays.
+void test_dedupe_stale_id_does_not_reset_window() {
+  for (int32_t id = 1970; id <= 2000; id++) recordCommandId(0, id);
+  applyNetworkPollResult(makeCommand(0, true, 1, 5));
+  TEST_ASSERT_EQUAL(0, pendingCommandDeviceCount[0]);
+  recordCommandId(0, 5);
+  TEST_ASSERT_EQUAL(2000, commandDedupe[0].highestId);
+  TEST_ASSERT_TRUE(commandIdSeen(0, 1990));
+  applyNetworkPollResult(makeCommand(0, true, 1, 1990));
+  TEST_ASSERT_EQUAL(0, pendingCommandDeviceCount[0]);
+  TEST_ASSERT_EQUAL(1990, lastRejectedCommandId[0]);
+}
+
+// loop() only stages the window; the network task does the NVS write.
+void test_dedupe_persist_is_handed_to_network_task() {
+  recordCommandId(1, 42);
+  stageCommandDedupe();
+  TEST_ASSERT_FALSE(commandDedupeDirty);
+  TEST_ASSERT_TRUE(commandDedupePersistPending);
+  TEST_ASSERT_EQUAL(42, commandDedupeStaged[1].highestId);
+  recordCommandId(1, 43);
+  TEST_ASSERT_EQUAL(42, commandDedupeStaged[1].highestId);
+  persistCommandDedupeIfPending();
+  // The shim Preferences has no storage, so the write is retried.
+  TEST_ASSERT_TRUE(commandDedupePersistPending);
+}
+
+// One ACTIVE_WAIT task on channel 0 for device 0, holding until holdUntilUs.
+static RelayCheckpointBlock makeCheckpoint(int64_t holdUntilUs) {
+  RelayCheckpointBlock block;
+  memset(&block, 0, sizeof(block));
+  block.magic = RELAY_CHECKPOINT_MAGIC;
+  block.channels[0].phase = RELAY_PHASE_ACTIVE_WAIT;
+  block.channels[0].deviceIndex = 0;
+  block.channels[0].commandId = 77;
+  block.channels[0].holdUntilUs = holdUntilUs;
+  block.channels[1].deviceIndex = -1;
+  block.checksum = checkpointChecksum(block);
+  return block;
+}
+
+static RelayCheckpointBlock flashCheckpoint() {
+  RelayCheckpointBlock block;
+  memset(&block, 0, sizeof(block));
+  Preferences store;
+  TEST_ASSERT_TRUE(store.begin(NVS_NS, true));
+  TEST_ASSERT_EQUAL(sizeof(block),
+                    store.getBytes(NVS_KEY_RELAY_CHECKPOINT, &block, sizeof(block)));
+  store.end();
+  return block;
+}
+
+// The latch-on and finish edges reach flash without the network task.
+void test_relay_edges_write_flash_checkpoint() {
+  shimPrefsAvailable = true;
+  startRelayPulse(0, 5000, millis(), 0, "DEV001", 9, millis());
+  TEST_ASSERT_EQUAL(0, shimPrefsWrites);
+  TEST_ASSERT_TRUE(checkpointPersistPending);
+
+  shimMillis += RELAY_PULSE_MS;
+  updateRelayPulses(millis());
+  TEST_ASSERT_EQUAL(1, shimPrefsWrites);
+  TEST_ASSERT_FALSE(checkpointPersistPending);
+  TEST_ASSERT_EQUAL(RELAY_PHASE_ACTIVE_WAIT, flashCheckpoint().channels[0].phase);
+
+  shimMillis += 5000;
+  updateRelayPulses(millis());
+  TEST_ASSERT_EQUAL(1, shimPrefsWrites);
+  shimMillis += RELAY_PULSE_MS;
+  updateRelayPulses(millis());
+  TEST_ASSERT_EQUAL(2, shimPrefsWrites);
+  TEST_ASSERT_EQUAL(RELAY_PHASE_IDLE, flashCheckpoint().channels[0].phase);
+  TEST_ASSERT_EQUAL(1, pendingInvoiceCount);
+}
+
+// A valid RTC checkpoint with hold left resumes the task without billing.
+void test_recover_resumes_rtc_hold() {
+  rtcCheckpoint = makeCheckpoint(systemTimeUs() + 60000000LL);
+  TEST_ASSERT_TRUE(recoverRelayTasks());
+  TEST_ASSERT_TRUE(relayState[0]);
+  TEST_ASSERT_EQUAL(RELAY_PHASE_ACTIVE_WAIT, relayPhase[0]);
+  TEST_ASSERT_EQUAL(77, relayTrace[0].commandId);
+  TEST_ASSERT_EQUAL(1, activeTaskCount[0]);
+  TEST_ASSERT_EQUAL(0, pendingInvoiceCount);
+  uint32_t remainingMs = pulseUntilMs[0] - millis();
+  TEST_ASSERT_TRUE(remainingMs > 59000 && remainingMs <= 60000);
+}
+
+// An expired RTC hold is closed with a stop pulse and billed once.
+void test_recover_closes_expired_rtc_hold() {
+  shimPrefsAvailable = true;
+  rtcCheckpoint = makeCheckpoint(systemTimeUs() - 1000000LL);
+  uint32_t writesBefore = shimPinWrites;
+  TEST_ASSERT_FALSE(recoverRelayTasks());
+  TEST_ASSERT_FALSE(relayState[0]);
+  TEST_ASSERT_EQUAL(2, shimPinWrites - writesBefore);
+  TEST_ASSERT_EQUAL(1, pendingInvoiceCount);
+  TEST_ASSERT_EQUAL(77, pendingInvoices[pendingInvoiceHead].trace.commandId);
+  TEST_ASSERT_EQUAL(RELAY_PHASE_IDLE, rtcCheckpoint.channels[0].phase);
+  TEST_ASSERT_EQUAL(RELAY_PHASE_IDLE, flashCheckpoint().channels[0].phase);
+}
+
+// After a power loss only flash is left: ACTIVE_WAIT is closed and billed,
+// never resumed, and the closed state is on flash before loop() starts.
+void test_recover_closes_flash_only_task() {
+  shimPrefsAvailable = true;
+  RelayCheckpointBlock block = makeCheckpoint(systemTimeUs() + 60000000LL);
+  Preferences store;
+  store.begin(NVS_NS, false);
+  store.putBytes(NVS_KEY_RELAY_CHECKPOINT, &block, sizeof(block));
+  store.end();
+
+  uint32_t writesBefore = shimPinWrites;
+  TEST_ASSERT_FALSE(recoverRelayTasks());
+  TEST_ASSERT_FALSE(relayState[0]);
+  TEST_ASSERT_EQUAL(2, shimPinWrites - writesBefore);
+  TEST_ASSERT_EQUAL(1, pendingInvoiceCount);
+  TEST_ASSERT_EQUAL_STRING(CONFIG_DEFAULTS.deviceId,
+                           pendingInvoices[pendingInvoiceHead].deviceId);
+  TEST_ASSERT_EQUAL(RELAY_PHASE_IDLE, flashCheckpoint().channels[0].phase);
+
+  // A second power loss right after boot finds nothing left to bill.
+  memset(&rtcCheckpoint, 0, sizeof(rtcCheckpoint));
+  TEST_ASSERT_FALSE(recoverRelayTasks());
+  TEST_ASSERT_EQUAL(1, pendingInvoiceCount);
+}
+
+// A replay is logged once per id, and the UART command clears the window.
+void test_dedupe_reset_command() {
+  recordCommandId(0, 5000);
+  recordCommandId(1, 5000);
+  applyNetworkPollResult(makeCommand(0, true, 1, 5000));
+  TEST_ASSERT_EQUAL(5000, lastRejectedCommandId[0]);
+  TEST_ASSERT_EQUAL(0, pendingCommandDeviceCount[0]);
+
+  shimSerialInput = "dedupe-reset 0\n";
+  processUartCommands();
+  TEST_ASSERT_EQUAL(-1, commandDedupe[0].highestId);
+  TEST_ASSERT_EQUAL(-1, lastRejectedCommandId[0]);
+  TEST_ASSERT_EQUAL(5000, commandDedupe[1].highestId);
+  applyNetworkPollResult(makeCommand(0, true, 1, 5000));
+  TEST_ASSERT_EQUAL(1, pendingCommandDeviceCount[0]);
+
+  shimSerialInput = "dedupe-reset 2\ndedupe-reset\n";
+  processUartCommands();
+  TEST_ASSERT_EQUAL(-1, commandDedupe[1].highestId);
+}
+
+// X counts only commands lost to a full FIFO, not id-less refusals while busy.
+void test_dropped_count_is_fifo_full_only() {
+  startRelayPulse(0, 5000, millis(), 0, "DEV001", 1, millis());
+  applyNetworkPollResult(makeCommand(0, true, 1, -1));
+  TEST_ASSERT_EQUAL(0, droppedCommandCount);
+  TEST_ASSERT_EQUAL(0, pendingCommandDeviceCount[0]);
+
+  for (int32_t id = 10; id < 10 + PENDING_COMMANDS_PER_DEVICE + 2; id++) {
+    applyNetworkPollResult(makeCommand(0, true, 1, id));
+  }
+  TEST_ASSERT_EQUAL(PENDING_COMMANDS_PER_DEVICE, pendingCommandDeviceCount[0]);
+  TEST_ASSERT_EQUAL(2, droppedCommandCount);
+}
+
+// Random command, replay, cancel and no-command sequences for both devices,
+// with time crossing the millis() rollover. Every started command must be
+// invoiced exactly once, in FIFO order, after holding for its duration.
+struct ModelTask {
+  uint8_t device;
+  int32_t commandId;
+  uint32_t durationMs;
+};
+
+static void runBillingSimulation(uint32_t seed) {
+  resetCoreState();
+  std::mt19937 rng(seed);
+  shimMillis = 0xFFFFFFFFUL - 90000UL - (rng() % 60000UL);
+
+  const uint32_t maxTickMs = 200;
+  std::deque<ModelTask> queued[2];
+  std::vector<ModelTask> started;
+  std::map<int32_t, ModelTask> running;
+  std::vector<int32_t> replayable[2];
+  std::set<int32_t> invoiced;
+  int32_t nextId[2] = { 1, 1000000 };  // disjoint so ids key the model maps
+  int32_t lastRunning[2] = { -1, -1 };
+
+  auto checkStartsAndInvoices = [&]() {
+    for (uint8_t d = 0; d < 2; d++) {
+      if (!relayState[d] || relayTrace[d].commandId == lastRunning[d]) continue;
+      TEST_ASSERT_FALSE_MESSAGE(queued[d].empty(), "relay started without a queued command");
+      ModelTask task = queued[d].front();
+      queued[d].pop_front();
+      TEST_ASSERT_EQUAL_INT(task.commandId, relayTrace[d].commandId);
+      TEST_ASSERT_EQUAL_INT(d, relayDeviceIndex[d]);
+      lastRunning[d] = task.commandId;
+      started.push_back(task);
+      running[task.commandId] = task;
+    }
+
+    InvoiceRequest req;
+    while (peekInvoiceRequest(&req)) {
+      popInvoiceRequest();
+      int32_t id = req.trace.commandId;
+      TEST_ASSERT_TRUE_MESSAGE(running.count(id) == 1, "invoice for a command that never ran");
+      TEST_ASSERT_TRUE_MESSAGE(invoiced.insert(id).second, "command invoiced twice");
+      const ModelTask& task = running[id];
+      TEST_ASSERT_EQUAL(task.device, req.deviceIndex);
+      uint32_t heldMs = req.trace.finishedMs - req.trace.startedMs;
+      TEST_ASSERT_GREATER_OR_EQUAL(task.durationMs + RELAY_PULSE_MS, heldMs);
+      TEST_ASSERT_LESS_OR_EQUAL(task.durationMs + RELAY_PULSE_MS + 2 * maxTickMs, heldMs);
+      running.erase(id);
+    }
+
+    TEST_ASSERT_EQUAL(pendingCommandDeviceCount[0] + pendingCommandDeviceCount[1],
+                      pendingCommandCount);
+    for (uint8_t d = 0; d < 2; d++) {
+      TEST_ASSERT_EQUAL(queued[d].size(), pendingCommandDeviceCount[d]);
+    }
+  };
+
+  auto advance = [&](uint32_t totalMs) {
+    while (totalMs > 0) {
+      uint32_t step = 1 + rng() % maxTickMs;
+      if (step > totalMs) step = totalMs;
+      totalMs -= step;
+      shimMillis += step;
+      uint32_t now = millis();
+      updateRelayPulses(now);
+      processInvoiceRequests(now);
+      processPendingCommands(now);
+      checkStartsAndInvoices();
+    }
+  };
+
+  for (int i = 0; i < 3000; i++) {
+    uint8_t d = (uint8_t)(rng() % 2);
+    int op = (int)(rng() % 10);
+    if (op <= 3) {
+      int32_t id = nextId[d]++;
+      uint32_t durationSec = 1 + rng() % 4;
+      bool hadRoom = queued[d].size() < PENDING_COMMANDS_PER_DEVICE;
+      applyNetworkPollResult(makeCommand(d, true, (int)durationSec, id));
+      if (hadRoom) {
+        queued[d].push_back({ d, id, durationSec * 1000U });
+        replayable[d].push_back(id);
+      }
+    } else if (op <= 5 && !replayable[d].empty()) {
+      // Backend re-serves a command the controller already accepted.
+      int32_t id = replayable[d][rng() % replayable[d].size()];
+      bool stillQueued = false;
+      for (const ModelTask& t : queued[d]) stillQueued |= (t.commandId == id);
+      bool hasRun = false;
+      for (const ModelTask& t : started) hasRun |= (t.commandId == id);
+      if (stillQueued || hasRun) {
+        uint8_t before = pendingCommandDeviceCount[d];
+        applyNetworkPollResult(makeCommand(d, true, 1, id));
+        TEST_ASSERT_EQUAL_MESSAGE(before, pendingCommandDeviceCount[d], "replay was queued");
+      }
+    } else if (op == 6) {
+      applyNetworkPollResult(makeCommand(d, false, 0, nextId[d]++));
+      queued[d].clear();
+    } else if (op == 7) {
+      NetworkPollResult none = makeCommand(d, false, 0, -1);
+      none.type = NETWORK_POLL_NO_COMMAND;
+      applyNetworkPollResult(none);
+    } else {
+      advance(1 + rng() % 3000);
+    }
+  }
+
+  advance((PENDING_COMMANDS_PER_DEVICE + 1) * 6000U);
+  TEST_ASSERT_EQUAL(0, pendingCommandCount);
+  TEST_ASSERT_TRUE(running.empty());
+  TEST_ASSERT_GREATER_THAN(100, started.size());
+  TEST_ASSERT_EQUAL(started.size(), invoiced.size());
+  TEST_ASSERT_FALSE(relayState[0] || relayState[1]);
+  TEST_ASSERT_TRUE_MESSAGE(shimMillis < 0x80000000UL, "simulation did not cross the rollover");
+}
+
+void test_billing_simulation_matches_model() {
+  for (uint32_t seed : SEEDS) {
+    runBillingSimulation(seed);
+  }
+}
+
+// The watchdog must release a channel without billing it.
+void test_watchdog_release_is_not_invoiced() {
+  shimMillis = 0xFFFFFF00UL;
+  startRelayPulse(0, 2000, millis(), 0, "DEV001", 99, millis());
+  shimMillis += 2000 + RELAY_WATCHDOG_GRACE_MS + 2 * RELAY_PULSE_MS;
+  updateRelayPulses(millis());
+  TEST_ASSERT_FALSE(relayState[0]);
+  TEST_ASSERT_EQUAL(0, pendingInvoiceCount);
+  TEST_ASSERT_EQUAL(0, activeTaskCount[0]);
+}
+
+// A device ID changed while the relay runs must not move the invoice to the
+// new id: the command was polled, and is billed, under the old one.
+void test_invoice_keeps_polled_device_id() {
+  startRelayPulse(0, 2000, millis(), 0, "DEV001", 5, millis());
+  RuntimeConfig next = activeConfig();
+  strcpy(next.deviceId, "DEV009");
+  String errorMsg;
+  TEST_ASSERT_TRUE(commitConfig(next, errorMsg));
+  for (int i = 0; i < 300; i++) {
+    shimMillis += 10;
+    updateRelayPulses(millis());
+  }
+
+  InvoiceRequest req;
+  TEST_ASSERT_TRUE(peekInvoiceRequest(&req));
+  TEST_ASSERT_EQUAL_STRING("DEV001", req.deviceId);
+  TEST_ASSERT_EQUAL(5, req.trace.commandId);
+}
+
+// Portal saves happen on the portal task; loop() applies them as one change.
+void test_portal_save_is_applied_by_loop() {
+  hostParam.setValue("10.0.0.77", sizeof(RuntimeConfig::hostIp));
+  stagePortalParams();
+  hostParam.setValue("", sizeof(RuntimeConfig::hostIp));
+  TEST_ASSERT_EQUAL_STRING(CONFIG_DEFAULTS.hostIp, activeConfig().hostIp);
+  applyPortalParams();
+  TEST_ASSERT_EQUAL_STRING("10.0.0.77", activeConfig().hostIp);
+  TEST_ASSERT_EQUAL_STRING(CONFIG_DEFAULTS.deviceId, activeConfig().deviceId);
+  TEST_ASSERT_FALSE(portalSavePending);
+}
+
+// The loop wait must never target a deadline it cannot act on, or it spins.
+void test_loop_wake_skips_unsendable_invoices() {
+  static int jobQueueStandin = 0;
+  shimMillis = 50000;
+  uint32_t now = millis();
+  lastStatusMs = now;
+  lastInvoiceAttemptMs = now - 5000;
+  InvoiceRequest req;
+  memset(&req, 0, sizeof(req));
+  req.deviceIndex = 0;
+  TEST_ASSERT_TRUE(enqueueInvoiceRequest(req));
+  TEST_ASSERT_TRUE(enqueuePendingCommand(0, 5000, "DEV001", 7, now));
+
+  // Wi-Fi down: the invoice cannot go out and no longer holds the command
+  // back, so the channel's cooldown is the only deadline.
+  relayCooldownUntilMs[0] = now + 300;
+  TEST_ASSERT_EQUAL(now + 300, nextLoopWakeMs(now));
+
+  // Channel cooling down: wake when it frees up, not at the past invoice slot.
+  shimWiFiStatus = WL_CONNECTED;
+  invoiceJobQueue = &jobQueueStandin;
+  TEST_ASSERT_EQUAL(now + 300, nextLoopWakeMs(now));
+
+  // Sendable: the invoice slot is due now.
+  relayCooldownUntilMs[0] = now - 1;
+  TEST_ASSERT_EQUAL(lastInvoiceAttemptMs + 1000U, nextLoopWakeMs(now));
+
+  // In flight: the result wakes the loop, the held command does not.
+  invoiceJobBusy = true;
+  TEST_ASSERT_EQUAL(now + STATUS_INTERVAL_MS, nextLoopWakeMs(now));
+}
+
+// Steady-state traffic must ride one kept-alive connection per link, so the
+// handshake count stays flat while requests grow.
+void test_backend_link_reuses_connection() {
+  uint32_t accepted = 0;
+  shimConnectHandler = [&](const char*, uint16_t port) {
+    accepted++;
+    return port == backendPort();
+  };
+  shimHttpHandler = [](const std::string&, uint16_t, const char*, const std::string& url,
+                       const std::string&, std::string& response) {
+    response = "{\"has_command\": false}";
+    return url.find("/api/device/DEV001/next/") != std::string::npos ? 200 : 404;
+  };
+
+  for (int i = 0; i < 1800; i++) {
+    String body;
+    TEST_ASSERT_EQUAL(200, backendRequest(pollLink, endpointFor("10.0.0.5"), "/api/device/DEV001/next/",
+                                          nullptr, HTTP_TIMEOUT_MS, body));
+    TEST_ASSERT_TRUE(jsonHas(body, "has_command", "false"));
+  }
+  TEST_ASSERT_EQUAL(1, accepted);
+  TEST_ASSERT_EQUAL(1, pollLink.connects);
+  TEST_ASSERT_EQUAL(1800, pollLink.requests);
+  TEST_ASSERT_EQUAL(0, pollLink.failures);
+
+  // A different host needs its own connection.
+  String body;
+  TEST_ASSERT_EQUAL(200, backendRequest(pollLink, endpointFor("10.0.0.6"), "/api/device/DEV001/next/",
+                                        nullptr, HTTP_TIMEOUT_MS, body));
+  TEST_ASSERT_EQUAL(2, pollLink.connects);
+}
+
+void test_backend_link_retries_stale_connection_once() {
+  uint32_t accepted = 0;
+  uint32_t handled = 0;
+  std::deque<int> failNext;
+  shimConnectHandler = [&](const char*, uint16_t) {
+    accepted++;
+    return true;
+  };
+  shimHttpHandler = [&](const std::string&, uint16_t, const char*, const std::string&,
+                        const std::string& body, std::string& response) {
+    if (!failNext.empty()) {
+      int code = failNext.front();
+      failNext.pop_front();
+      if (code != HTTPC_ERROR_SEND_HEADER_FAILED) handled++;
+      return code;
+    }
+    handled++;
+    TEST_ASSERT_TRUE(body.empty() || body.find("\"amount\"") != std::string::npos);
+    response = "{\"public_id\":\"inv1\",\"pay_url\":\"http://pay/inv1\"}";
+    return 201;
+  };
+
+  const char* path = "/api/device/DEV001/request-invoice/";
+  String body("{\"amount\":\"5.00\"}");
+  String response;
+  TEST_ASSERT_EQUAL(201, backendRequest(invoiceLink, endpointFor("10.0.0.5"), path, &body,
+                                        INVOICE_HTTP_TIMEOUT_MS, response));
+  TEST_ASSERT_EQUAL(1, accepted);
+
+  // The backend closed the idle socket before the headers went out: one
+  // transparent reconnect.
+  failNext = { HTTPC_ERROR_SEND_HEADER_FAILED };
+  TEST_ASSERT_EQUAL(201, backendRequest(invoiceLink, endpointFor("10.0.0.5"), path, &body,
+                                        INVOICE_HTTP_TIMEOUT_MS, response));
+  TEST_ASSERT_EQUAL(2, accepted);
+  TEST_ASSERT_EQUAL(2, handled);
+  TEST_ASSERT_TRUE(jsonHas(response, "public_id", "\"inv1\""));
+
+  // A POST that timed out waiting for the answer may have been handled:
+  // it must not be sent again.
+  failNext = { HTTPC_ERROR_READ_TIMEOUT, 201 };
+  TEST_ASSERT_EQUAL(HTTPC_ERROR_READ_TIMEOUT,
+                    backendRequest(invoiceLink, endpointFor("10.0.0.5"), path, &body,
+                                   INVOICE_HTTP_TIMEOUT_MS, response));
+  TEST_ASSERT_EQUAL(3, handled);
+  TEST_ASSERT_EQUAL(1, failNext.size());
+  failNext.clear();
+
+  // Same for a connection lost after the body went out.
+  TEST_ASSERT_EQUAL(201, backendRequest(invoiceLink, endpointFor("10.0.0.5"), path, &body,
+                                        INVOICE_HTTP_TIMEOUT_MS, response));
+  failNext = { HTTPC_ERROR_CONNECTION_LOST, 201 };
+  TEST_ASSERT_EQUAL(HTTPC_ERROR_CONNECTION_LOST,
+                    backendRequest(invoiceLink, endpointFor("10.0.0.5"), path, &body,
+                                   INVOICE_HTTP_TIMEOUT_MS, response));
+  TEST_ASSERT_EQUAL(1, failNext.size());
+  failNext.clear();
+
+  // An idempotent GET may be retried after any failure on a reused socket.
+  String pollBody;
+  TEST_ASSERT_EQUAL(201, backendRequest(invoiceLink, endpointFor("10.0.0.5"), path, nullptr,
+                                        HTTP_TIMEOUT_MS, pollBody));
+  failNext = { HTTPC_ERROR_READ_TIMEOUT };
+  TEST_ASSERT_EQUAL(201, backendRequest(invoiceLink, endpointFor("10.0.0.5"), path, nullptr,
+                                        HTTP_TIMEOUT_MS, pollBody));
+
+  // When the fresh connection fails too, the error is returned.
+  failNext = { HTTPC_ERROR_SEND_HEADER_FAILED, HTTPC_ERROR_SEND_HEADER_FAILED };
+  TEST_ASSERT_TRUE(backendRequest(invoiceLink, endpointFor("10.0.0.5"), path, &body,
+                                  INVOICE_HTTP_TIMEOUT_MS, response) <= 0);
+  TEST_ASSERT_TRUE(failNext.empty());
+  TEST_ASSERT_EQUAL(3, invoiceLink.failures);
+}
+
+void test_backend_link_counts_refused_connects() {
+  shimConnectHandler = [](const char*, uint16_t) { return false; };
+  String body;
+  TEST_ASSERT_TRUE(backendRequest(pollLink, endpointFor("10.0.0.5"), "/api/device/DEV001/next/",
+                                  nullptr, HTTP_TIMEOUT_MS, body) <= 0);
+  TEST_ASSERT_EQUAL(1, pollLink.connects);
+  TEST_ASSERT_EQUAL(1, pollLink.failures);
+}
+
+// Stand-in pool for the failover tests: per-port reachability, status code
+// and latency, with latency charged to shimMillis like a real round trip.
+struct StandinHost {
+  bool up;
+  int status;
+  uint32_t latencyMs;
+  uint32_t connects;
+  uint32_t requests;
+};
+
+static std::map<uint16_t, StandinHost> standins;
+
+static void installStandins(const char* backends) {
+  standins.clear();
+  RuntimeConfig cfg = CONFIG_DEFAULTS;
+  strncpy(cfg.backends, backends, sizeof(cfg.backends) - 1);
+  loadBackendEndpoints(cfg);
+  for (uint8_t i = 0; i < backendCount; i++) {
+    standins[backendHealth[i].endpoint.port] = { true, 200, 20, 0, 0 };
+  }
+  shimConnectHandler = [](const char*, uint16_t port) {
+    StandinHost& host = standins[port];
+    host.connects++;
+    return host.up;
+  };
+  shimHttpHandler = [](const std::string&, uint16_t port, const char*, const std::string&,
+                       const std::string&, std::string& response) {
+    StandinHost& host = standins[port];
+    if (!host.up) return HTTPC_ERROR_CONNECTION_LOST;
+    host.requests++;
+    shimMillis += host.latencyMs;
+    response = "{\"has_command\": false}";
+    return host.status;
+  };
+}
+
+static int pollOnce(bool probe = false) {
+  String body;
+  return backendCall(pollLink, "/api/device/DEV001/next/", nullptr, HTTP_TIMEOUT_MS,
+                     body, probe);
+}
+
+void test_backend_list_validation() {
+  RuntimeConfig cfg = CONFIG_DEFAULTS;
+  String errorMsg;
+  TEST_ASSERT_TRUE(setConfigField(&cfg, "backends", "192.168.0.132, 192.168.0.133:8001",
+                                  errorMsg));
+  BackendEndpoint endpoints[BACKEND_MAX_HOSTS];
+  uint8_t count = 0;
+  TEST_ASSERT_TRUE(parseBackendList(cfg, endpoints, &count, errorMsg));
+  TEST_ASSERT_EQUAL(3, count);
+  TEST_ASSERT_EQUAL_STRING(CONFIG_DEFAULTS.hostIp, endpoints[0].host);
+  TEST_ASSERT_EQUAL(backendPort(), endpoints[1].port);
+  TEST_ASSERT_EQUAL_STRING("192.168.0.133", endpoints[2].host);
+  TEST_ASSERT_EQUAL(8001, endpoints[2].port);
+
+  TEST_ASSERT_TRUE(setConfigField(&cfg, "backends", "none", errorMsg));
+  TEST_ASSERT_EQUAL_STRING("", cfg.backends);
+
+  const char* invalid[] = {
+    "192.168.0.300", "192.168.0.132:0", "192.168.0.132:70000", "192.168.0.132:",
+    "host.local", "192.168.0.131", "10.0.0.1,10.0.0.2,10.0.0.3,10.0.0.4",
+    "10.0.0.1:8001,10.0.0.1:8001"
+  };
+  for (const char* value : invalid) {
+    RuntimeConfig before = cfg;
+    TEST_ASSERT_FALSE_MESSAGE(setConfigField(&cfg, "backends", value, errorMsg), value);
+    TEST_ASSERT_EQUAL_STRING(before.backends, cfg.backends);
+  }
+
+  // host_ip moving onto a backup host is caught when the change is applied.
+  RuntimeConfig next = CONFIG_DEFAULTS;
+  TEST_ASSERT_TRUE(setConfigField(&next, "backends", "10.0.0.9", errorMsg));
+  TEST_ASSERT_TRUE(setConfigField(&next, "host_ip", "10.0.0.9", errorMsg));
+  TEST_ASSERT_FALSE(commitConfig(next, errorMsg));
+}
+
+// Config errors echo client input, which must not break out of the string.
+void test_config_error_is_json_escaped() {
+  RuntimeConfig cfg = CONFIG_DEFAULTS;
+  String errorMsg;
+  TEST_ASSERT_FALSE(setConfigField(&cfg, "x\",\"admin\":true,\"y", "1", errorMsg));
+  TEST_ASSERT_EQUAL_STRING("\"x\\\",\\\"admin\\\":true,\\\"y: unknown key\"",
+                           jsonQuoted(errorMsg).c_str());
+  TEST_ASSERT_EQUAL_STRING("\"a\\\\b\\u000a\"", jsonQuoted("a\\b\n").c_str());
+}
+
+// A dead host costs one extra attempt per request until it is benched, then
+// none; once the cooldown expires, probes retry it and traffic fails back
+// after it answers.
+void test_backend_failover_and_failback() {
+  installStandins("10.0.0.2:8001");
+  uint16_t primary = backendPort();
+  standins[primary].up = false;
+  standins[8001].latencyMs = 50;
+
+  for (int i = 0; i < BACKEND_FAILS_TO_DOWN; i++) {
+    TEST_ASSERT_EQUAL(200, pollOnce());
+  }
+  TEST_ASSERT_EQUAL(BACKEND_FAILS_TO_DOWN, standins[primary].connects);
+  TEST_ASSERT_EQUAL(BACKEND_FAILS_TO_DOWN, standins[8001].requests);
+
+  for (int i = 0; i < 20; i++) {
+    TEST_ASSERT_EQUAL(200, pollOnce());
+  }
+  TEST_ASSERT_EQUAL(BACKEND_FAILS_TO_DOWN, standins[primary].connects);
+  TEST_ASSERT_EQUAL(1, backendPreferred);
+  // The poll link only left the backup while the primary was still tried.
+  TEST_ASSERT_EQUAL(BACKEND_FAILS_TO_DOWN, standins[8001].connects);
+
+  // Still down at the first retry: the cooldown doubles.
+  shimMillis += BACKEND_COOLDOWN_MIN_MS;
+  TEST_ASSERT_EQUAL(200, pollOnce(true));
+  TEST_ASSERT_EQUAL(BACKEND_FAILS_TO_DOWN + 1, standins[primary].connects);
+  shimMillis += BACKEND_COOLDOWN_MIN_MS;
+  TEST_ASSERT_EQUAL(200, pollOnce(true));
+  TEST_ASSERT_EQUAL(BACKEND_FAILS_TO_DOWN + 1, standins[primary].connects);
+
+  // Back up but never measured: sampled by a probe, then traffic moves.
+  standins[primary].up = true;
+  standins[primary].latencyMs = 10;
+  shimMillis += BACKEND_COOLDOWN_MIN_MS;
+  TEST_ASSERT_EQUAL(200, pollOnce(true));
+  TEST_ASSERT_EQUAL(1, backendPreferred);
+  TEST_ASSERT_EQUAL(200, pollOnce());
+  TEST_ASSERT_EQUAL(0, backendPreferred);
+  TEST_ASSERT_EQUAL(0, backendHealth[0].consecutiveFailures);
+  uint32_t backupRequests = standins[8001].requests;
+  for (int i = 0; i < 10; i++) {
+    TEST_ASSERT_EQUAL(200, pollOnce());
+  }
+  TEST_ASSERT_EQUAL(backupRequests, standins[8001].requests);
+}
+
+void test_backend_fails_over_on_server_error() {
+  installStandins("10.0.0.2:8001");
+  standins[backendPort()].status = 503;
+  TEST_ASSERT_EQUAL(200, pollOnce());
+  TEST_ASSERT_EQUAL(1, standins[backendPort()].requests);
+  TEST_ASSERT_EQUAL(1, standins[8001].requests);
+  TEST_ASSERT_EQUAL(1, backendHealth[0].consecutiveFailures);
+
+  // 4xx is an answer, not a host failure.
+  standins[backendPort()].status = 404;
+  standins[8001].status = 404;
+  backendHealth[0].consecutiveFailures = 0;
+  TEST_ASSERT_EQUAL(404, pollOnce());
+  TEST_ASSERT_EQUAL(0, backendHealth[0].consecutiveFailures);
+
+  // Every host failing returns the last error.
+  standins[backendPort()].up = false;
+  standins[8001].up = false;
+  TEST_ASSERT_TRUE(pollOnce() <= 0);
+}
+
+// A host without an RTT yet never takes over the main link on its own; the
+// next probe samples it, and it only wins once it beats the margin.
+void test_backend_unmeasured_host_is_probed_not_preferred() {
+  installStandins("10.0.0.2:8001");
+  uint16_t primary = backendPort();
+  standins[primary].latencyMs = 40;
+  standins[8001].latencyMs = 35;
+  for (int i = 0; i < 5; i++) pollOnce();
+  TEST_ASSERT_EQUAL(0, backendPreferred);
+  TEST_ASSERT_EQUAL(0, standins[8001].requests);
+  uint32_t pollConnects = pollLink.connects;
+  uint32_t switches = backendSwitchCount;
+
+  TEST_ASSERT_EQUAL(200, pollOnce(true));
+  TEST_ASSERT_EQUAL(1, standins[8001].requests);
+  TEST_ASSERT_EQUAL(1, probeLink.connects);
+  TEST_ASSERT_EQUAL(pollConnects, pollLink.connects);
+  TEST_ASSERT_TRUE(backendHealth[1].rttEwmaMs > 0);
+  // Measured but within the margin: no switch, and no second probe before
+  // the interval.
+  for (int i = 0; i < 10; i++) pollOnce(true);
+  TEST_ASSERT_EQUAL(0, backendPreferred);
+  TEST_ASSERT_EQUAL(1, standins[8001].requests);
+  TEST_ASSERT_EQUAL(switches, backendSwitchCount);
+}
+
+// Probes ride their own short-lived link, so the poll connection survives
+// them: one connect per probe and none on the poll link.
+void test_backend_probe_keeps_poll_connection() {
+  installStandins("10.0.0.2:8001");
+  standins[8001].latencyMs = 60;
+  for (int i = 0; i < 5; i++) pollOnce();
+  TEST_ASSERT_EQUAL(0, backendPreferred);
+  uint32_t pollConnects = pollLink.connects;
+  uint32_t backupRequests = standins[8001].requests;
+
+  for (int i = 0; i < 5; i++) {
+    shimMillis += BACKEND_PROBE_INTERVAL_MS;
+    TEST_ASSERT_EQUAL(200, pollOnce(true));
+    TEST_ASSERT_EQUAL(200, pollOnce(true));
+  }
+  TEST_ASSERT_EQUAL(0, backendPreferred);
+  TEST_ASSERT_EQUAL(pollConnects, pollLink.connects);
+  TEST_ASSERT_EQUAL(5, probeLink.connects);
+  TEST_ASSERT_EQUAL(backupRequests + 5, standins[8001].requests);
+  TEST_ASSERT_FALSE(backendClient(probeLink).connected());
+}
+
+// An invoice POST only moves to the next host when nothing reached the first.
+void test_backend_post_fails_over_only_before_sending() {
+  installStandins("10.0.0.2:8001");
+  uint16_t primary = backendPort();
+  String payload("{}");
+  String response;
+
+  standins[primary].status = 503;
+  TEST_ASSERT_EQUAL(503, backendCall(invoiceLink, "/api/device/DEV001/request-invoice/",
+                                     &payload, INVOICE_HTTP_TIMEOUT_MS, response, false));
+  TEST_ASSERT_EQUAL(1, standins[primary].requests);
+  TEST_ASSERT_EQUAL(0, standins[8001].requests);
+
+  // Refused connect: nothing was sent, so the backup takes it.
+  standins[primary].status = 200;
+  standins[primary].up = false;
+  backendClient(invoiceLink).stop();
+  TEST_ASSERT_EQUAL(200, backendCall(invoiceLink, "/api/device/DEV001/request-invoice/",
+                                     &payload, INVOICE_HTTP_TIMEOUT_MS, response, false));
+  TEST_ASSERT_EQUAL(1, standins[8001].requests);
+
+  // The first host took the body and timed out: not sent anywhere else.
+  standins[primary].up = true;
+  backendHealth[0].consecutiveFailures = 0;
+  backendHealth[0].downUntilMs = 0;
+  backendHealth[1].rttEwmaMs = 1000;
+  shimHttpHandler = [](const std::string&, uint16_t port, const char*, const std::string&,
+                       const std::string&, std::string&) {
+    standins[port].requests++;
+    return HTTPC_ERROR_READ_TIMEOUT;
+  };
+  TEST_ASSERT_EQUAL(HTTPC_ERROR_READ_TIMEOUT,
+                    backendCall(invoiceLink, "/api/device/DEV001/request-invoice/", &payload,
+                                INVOICE_HTTP_TIMEOUT_MS, response, false));
+  TEST_ASSERT_EQUAL(2, standins[primary].requests);
+  TEST_ASSERT_EQUAL(1, standins[8001].requests);
+}
+
+// Invoice jobs run in the network task: a batch 404 comes back in the result
+// instead of touching loop() state, and a single job uses the device endpoint.
+static std::vector<std::string> invoiceUrls;
+
+void test_invoice_job_reports_results() {
+  installStandins("");
+  invoiceUrls.clear();
+  shimHttpHandler = [](const std::string&, uint16_t, const char*, const std::string& url,
+                       const std::string&, std::string&) {
+    invoiceUrls.push_back(url);
+    return url.find("/batch/") != std::string::npos ? 404 : 500;
+  };
+  InvoiceJob job;
+  memset(&job, 0, sizeof(job));
+  job.count = 2;
+  job.items[0].deviceIndex = 0;
+  job.items[1].deviceIndex = 1;
+  strcpy(job.items[0].deviceId, "DEV001");
+  strcpy(job.items[1].deviceId, "DEV002");
+  strcpy(job.amount, "5.00");
+  job.durationSec = 60;
+
+  InvoiceJobResult result;
+  runInvoiceJob(job, &result);
+  TEST_ASSERT_TRUE(result.batchUnsupported);
+  TEST_ASSERT_FALSE(result.itemOk[0] || result.itemOk[1]);
+  TEST_ASSERT_TRUE(invoiceBatchSupported);
+
+  job.count = 1;
+  runInvoiceJob(job, &result);
+  TEST_ASSERT_FALSE(result.batchUnsupported);
+  TEST_ASSERT_FALSE(result.itemOk[0]);
+  TEST_ASSERT_EQUAL(2, invoiceUrls.size());
+  TEST_ASSERT_TRUE(invoiceUrls[1].find("/api/device/DEV001/request-invoice/") !=
+                   std::string::npos);
+}
+
+// Batch results map to items by position. Each slot below runs the way
+// loop() and networkTask() split it: processInvoiceRequests() hands the job
+// over, the test runs it against a scripted backend and hands the result back.
+static std::vector<std::string> invoiceBodies;
+static int invoiceStatus = 201;
+static std::string invoiceResponse;
+
+static void queueInvoice(int32_t commandId) {
+  InvoiceRequest req;
+  memset(&req, 0, sizeof(req));
+  req.deviceIndex = 0;
+  req.trace.commandId = commandId;
+  strcpy(req.deviceId, "DEV001");
+  TEST_ASSERT_TRUE(enqueueInvoiceRequest(req));
+}
+
+static void runInvoiceSlot() {
+  shimMillis += 1000;
+  processInvoiceRequests(millis());
+  InvoiceJob job;
+  TEST_ASSERT_EQUAL(pdTRUE, xQueueReceive(invoiceJobQueue, &job, 0));
+  InvoiceJobResult result;
+  runInvoiceJob(job, &result);
+  TEST_ASSERT_EQUAL(pdTRUE, xQueueSend(invoiceResultQueue, &result, 0));
+  collectInvoiceJobResult();
+  TEST_ASSERT_FALSE(invoiceJobBusy);
+}
+
+static void beginInvoiceBatchTest() {
+  installStandins("");
+  shimWiFiStatus = WL_CONNECTED;
+  shimMillis = 10000;
+  invoiceJobQueue = xQueueCreate(1, sizeof(InvoiceJob));
+  invoiceResultQueue = xQueueCreate(1, sizeof(InvoiceJobResult));
+  invoiceBodies.clear();
+  invoiceStatus = 201;
+  shimHttpHandler = [](const std::string&, uint16_t, const char*, const std::string&,
+                       const std::string& body, std::string& response) {
+    invoiceBodies.push_back(body);
+    response = invoiceResponse;
+    return invoiceStatus;
+  };
+  for (int32_t id = 1; id <= 3; id++) queueInvoice(id);
+}
+
+static void endInvoiceBatchTest() {
+  vQueueDelete(invoiceJobQueue);
+  vQueueDelete(invoiceResultQueue);
+  invoiceJobQueue = nullptr;
+  invoiceResultQueue = nullptr;
+}
+
+static std::string batchResult(const char* deviceId, const char* publicId) {
+  return std::string("{\"device_id\":\"") + deviceId + "\",\"public_id\":\"" + publicId +
+         "\",\"pay_url\":\"https://pay.example/" + publicId + "\"}";
+}
+
+static int32_t pendingInvoiceCommandId(uint8_t offset) {
+  return pendingInvoices[(pendingInvoiceHead + offset) % (RELAY_CHANNEL_COUNT * 2)]
+    .trace.commandId;
+}
+
+void test_invoice_batch_success() {
+  beginInvoiceBatchTest();
+  invoiceResponse = "{\"results\":[" + batchResult("DEV001", "a") + "," +
+                    batchResult("DEV001", "b") + "," + batchResult("DEV001", "c") + "]}";
+  runInvoiceSlot();
+  TEST_ASSERT_EQUAL(1, invoiceBodies.size());
+  TEST_ASSERT_TRUE(invoiceBodies[0].find("\"command_id\":3") != std::string::npos);
+  TEST_ASSERT_EQUAL(0, pendingInvoiceCount);
+  endInvoiceBatchTest();
+}
+
+// Only the item without an invoice goes back on the queue, once.
+void test_invoice_batch_partial_failure() {
+  beginInvoiceBatchTest();
+  invoiceResponse = "{\"results\":[" + batchResult("DEV001", "a") +
+                    ",{\"device_id\":\"DEV001\",\"error\":\"busy\"}," +
+                    batchResult("DEV001", "c") + "]}";
+  runInvoiceSlot();
+  TEST_ASSERT_EQUAL(1, pendingInvoiceCount);
+  TEST_ASSERT_EQUAL(2, pendingInvoiceCommandId(0));
+  TEST_ASSERT_EQUAL(1, pendingInvoices[pendingInvoiceHead].attempts);
+  endInvoiceBatchTest();
+}
+
+// A 201 with fewer results than items: the acknowledged prefix is done, the
+// unanswered tail is re-sent on its own, and nothing is sent twice.
+void test_invoice_batch_short_results() {
+  beginInvoiceBatchTest();
+  invoiceResponse = "{\"results\":[" + batchResult("DEV001", "a") + "," +
+                    batchResult("DEV001", "b") + "]}";
+  runInvoiceSlot();
+  TEST_ASSERT_EQUAL(1, pendingInvoiceCount);
+  TEST_ASSERT_EQUAL(3, pendingInvoiceCommandId(0));
+
+  invoiceResponse = "{\"public_id\":\"c\",\"pay_url\":\"https://pay.example/c\"}";
+  runInvoiceSlot();
+  TEST_ASSERT_EQUAL(0, pendingInvoiceCount);
+  TEST_ASSERT_EQUAL(2, invoiceBodies.size());
+  TEST_ASSERT_TRUE(invoiceBodies[1].find("\"command_id\":3") != std::string::npos);
+  TEST_ASSERT_TRUE(invoiceBodies[1].find("\"command_id\":1") == std::string::npos);
+  TEST_ASSERT_TRUE(invoiceBodies[1].find("\"command_id\":2") == std::string::npos);
+
+  // An empty results array acknowledges nothing: every item stays queued.
+  for (int32_t id = 4; id <= 6; id++) queueInvoice(id);
+  invoiceResponse = "{\"results\":[]}";
+  runInvoiceSlot();
+  TEST_ASSERT_EQUAL(3, pendingInvoiceCount);
+  endInvoiceBatchTest();
+}
+
+// A result answering for another device is not taken as this item's invoice.
+void test_invoice_batch_device_mismatch() {
+  beginInvoiceBatchTest();
+  invoiceResponse = "{\"results\":[" + batchResult("DEV002", "a") + "," +
+                    batchResult("DEV001", "b") + "," + batchResult("DEV001", "c") + "]}";
+  runInvoiceSlot();
+  TEST_ASSERT_EQUAL(1, pendingInvoiceCount);
+  TEST_ASSERT_EQUAL(1, pendingInvoiceCommandId(0));
+  endInvoiceBatchTest();
+}
+
+// Traffic follows the lower RTT EWMA, but only moves for a clear win, and
+// probes keep the other host's estimate fresh.
+void test_backend_latency_selection() {
+  installStandins("10.0.0.2:8001");
+  uint16_t primary = backendPort();
+  standins[primary].latencyMs = 80;
+  standins[8001].latencyMs = 20;
+  for (int i = 0; i < 5; i++) pollOnce(true);
+  TEST_ASSERT_EQUAL(1, backendPreferred);
+  uint32_t primaryRequests = standins[primary].requests;
+  for (int i = 0; i < 50; i++) pollOnce();
+  TEST_ASSERT_EQUAL(primaryRequests, standins[primary].requests);
+
+  // Slightly slower than the primary's estimate: within the margin, stay.
+  standins[8001].latencyMs = 90;
+  for (int i = 0; i < 60; i++) pollOnce();
+  TEST_ASSERT_EQUAL(1, backendPreferred);
+
+  // Clearly slower: move to the primary.
+  standins[8001].latencyMs = 200;
+  for (int i = 0; i < 60; i++) pollOnce();
+  TEST_ASSERT_EQUAL(0, backendPreferred);
+
+  // The backup recovers; only a probe can notice.
+  standins[8001].latencyMs = 20;
+  uint32_t backupRequests = standins[8001].requests;
+  for (int i = 0; i < 20; i++) pollOnce();
+  TEST_ASSERT_EQUAL(backupRequests, standins[8001].requests);
+  for (int i = 0; i < 40; i++) {
+    shimMillis += BACKEND_PROBE_INTERVAL_MS;
+    pollOnce(true);
+  }
+  TEST_ASSERT_EQUAL(1, backendPreferred);
+}
+
+int main() {
+  UNITY_BEGIN();
+  RUN_TEST(test_time_reached_wraparound);
+  RUN_TEST(test_json_int_matches_reference);
+  RUN_TEST(test_parse_http_body_round_trip);
+  RUN_TEST(test_invoice_ring_matches_model);
+  RUN_TEST(test_command_fifo_matches_model);
+  RUN_TEST(test_dedupe_window_matches_model);
+  RUN_TEST(test_dedupe_stale_id_does_not_reset_window);
+  RUN_TEST(test_dedupe_persist_is_handed_to_network_task);
+  RUN_TEST(test_relay_edges_write_flash_checkpoint);
+  RUN_TEST(test_recover_resumes_rtc_hold);
+  RUN_TEST(test_recover_closes_expired_rtc_hold);
+  RUN_TEST(test_recover_closes_flash_only_task);
+  RUN_TEST(test_dedupe_reset_command);
+  RUN_TEST(test_dropped_count_is_fifo_full_only);
+  RUN_TEST(test_billing_simulation_matches_model);
+  RUN_TEST(test_watchdog_release_is_not_invoiced);
+  RUN_TEST(test_invoice_keeps_polled_device_id);
+  RUN_TEST(test_portal_save_is_applied_by_loop);
+  RUN_TEST(test_loop_wake_skips_unsendable_invoices);
+  RUN_TEST(test_backend_link_reuses_connection);
+  RUN_TEST(test_backend_link_retries_stale_connection_once);
+  RUN_TEST(test_backend_link_counts_refused_connects);
+  RUN_TEST(test_backend_list_validation);
+  RUN_TEST(test_config_error_is_json_escaped);
+  RUN_TEST(test_backend_failover_and_failback);
+  RUN_TEST(test_backend_fails_over_on_server_error);
+  RUN_TEST(test_backend_unmeasured_host_is_probed_not_preferred);
+  RUN_TEST(test_backend_probe_keeps_poll_connection);
+  RUN_TEST(test_backend_post_fails_over_only_before_sending);
+  RUN_TEST(test_invoice_job_reports_results);
+  RUN_TEST(test_invoice_batch_success);
+  RUN_TEST(test_invoice_batch_partial_failure);
+  RUN_TEST(test_invoice_batch_short_results);
+  RUN_TEST(test_invoice_batch_device_mismatch);
+  RUN_TEST(test_backend_latency_selection);
+  return UNITY_END();
+}
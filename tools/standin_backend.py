@@ -0,0 +1,140 @@
+#!/usr/bin/env python3
+"""Local stand-in for the Scanpay backend endpoints the firmware uses.
+
+Speaks HTTP/1.1 with keep-alive, optionally over TLS, and logs every new
+connection so handshake reuse can be checked against the firmware's hourly
+"H" line. Run several on different ports to exercise host failover.
+
+    python3 tools/standin_backend.py --port 8000
+    python3 tools/standin_backend.py --port 8443 --cert cert.pem --key key.pem
+    python3 tools/standin_backend.py --port 8001 --delay-ms 400 --fail-rate 0.2
+"""
+import argparse
+import itertools
+import json
+import random
+import re
+import ssl
+import sys
+import threading
+import time
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+
+NEXT_RE = re.compile(r"^/api/device/([^/]+)/next/$")
+INVOICE_RE = re.compile(r"^/api/device/([^/]+)/request-invoice/$")
+BATCH_PATH = "/api/device/request-invoice/batch/"
+
+
+class Stats:
+    def __init__(self):
+        self.lock = threading.Lock()
+        self.connections = 0
+        self.requests = 0
+        self.invoice_ids = itertools.count(1)
+
+    def next_invoice(self):
+        with self.lock:
+            return "inv%d" % next(self.invoice_ids)
+
+
+def make_handler(args, stats):
+    class Handler(BaseHTTPRequestHandler):
+        protocol_version = "HTTP/1.1"
+
+        def setup(self):
+            super().setup()
+            with stats.lock:
+                stats.connections += 1
+                count = stats.connections
+            self.log_message("connect #%d from %s", count, self.client_address[0])
+
+        def log_message(self, fmt, *fmt_args):
+            sys.stderr.write("[:%d] %s\n" % (args.port, fmt % fmt_args))
+
+        def send_json(self, code, payload):
+            body = json.dumps(payload).encode()
+            self.send_response(code)
+            self.send_header("Content-Type", "application/json")
+            self.send_header("Content-Length", str(len(body)))
+            self.end_headers()
+            self.wfile.write(body)
+
+        def begin_request(self):
+            with stats.lock:
+                stats.requests += 1
+            if args.delay_ms:
+                time.sleep(args.delay_ms / 1000.0)
+            if args.fail_rate and random.random() < args.fail_rate:
+                self.send_json(503, {"error": "stand-in failure"})
+                return False
+            return True
+
+        def invoice(self, device_id):
+            public_id = stats.next_invoice()
+            return {
+                "device_id": device_id,
+                "public_id": public_id,
+                "pay_url": "http://localhost:%d/pay/%s" % (args.port, public_id),
+            }
+
+        def do_GET(self):
+            if not self.begin_request():
+                return
+            if NEXT_RE.match(self.path):
+                self.send_json(200, {"has_command": False})
+            else:
+                self.send_json(404, {"error": "not found"})
+
+        def do_POST(self):
+            length = int(self.headers.get("Content-Length", "0"))
+            raw = self.rfile.read(length) if length else b"{}"
+            if not self.begin_request():
+                return
+            try:
+                payload = json.loads(raw or b"{}")
+            except ValueError:
+                self.send_json(400, {"error": "invalid json"})
+                return
+            match = INVOICE_RE.match(self.path)
+            if match:
+                self.log_message("invoice %s %s", match.group(1), payload)
+                self.send_json(201, self.invoice(match.group(1)))
+            elif self.path == BATCH_PATH and not args.no_batch:
+                items = payload.get("items", [])
+                self.log_message("batch of %d", len(items))
+                results = [self.invoice(item.get("device_id", "")) for item in items]
+                self.send_json(201, {"results": results})
+            else:
+                self.send_json(404, {"error": "not found"})
+
+    return Handler
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--bind", default="0.0.0.0")
+    parser.add_argument("--port", type=int, default=8000)
+    parser.add_argument("--cert", help="PEM certificate; enables TLS with --key")
+    parser.add_argument("--key", help="PEM private key")
+    parser.add_argument("--delay-ms", type=int, default=0, help="added latency per request")
+    parser.add_argument("--fail-rate", type=float, default=0.0, help="fraction answered with 503")
+    parser.add_argument("--no-batch", action="store_true", help="answer the batch endpoint with 404")
+    args = parser.parse_args()
+
+    stats = Stats()
+    server = ThreadingHTTPServer((args.bind, args.port), make_handler(args, stats))
+    if args.cert:
+        context = ssl.SSLContext(ssl.PROTOCOL_TLS_SERVER)
+        context.load_cert_chain(args.cert, args.key)
+        server.socket = context.wrap_socket(server.socket, server_side=True)
+    scheme = "https" if args.cert else "http"
+    sys.stderr.write("stand-in backend on %s://%s:%d\n" % (scheme, args.bind, args.port))
+    try:
+        server.serve_forever()
+    except KeyboardInterrupt:
+        pass
+    sys.stderr.write("connections=%d requests=%d\n" % (stats.connections, stats.requests))
+
+
+if __name__ == "__main__":
+    main()